@@ -25,34 +25,87 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <pthread.h>
 #include "micronucleus_lib.h"
+#include "micronucleus_image.h"
+#include "micronucleus_sim.h"
+#ifdef MICRONUCLEUS_ASYNC
+  #include "micronucleus_async.h"
+#endif
 #include "littleWire_util.h"
 
 #define FILE_TYPE_INTEL_HEX 1
 #define FILE_TYPE_RAW 2
-#define CONNECT_WAIT 250 /* milliseconds to wait after detecting device on usb bus - probably excessive */
+#define CONNECT_WAIT 250 /* milliseconds --all waits for more devices after finding the first */
+#define MAX_DEVICES 64 /* most devices --all will flash at once */
+#define RESUME_TRIES 3 /* times a failed write reconnects and carries on */
+#define RECONNECT_WAIT 5000 /* milliseconds to wait for device to come back after a write error */
 
-/******************************************************************************
-* Global definitions 
-******************************************************************************/
-unsigned char dataBuffer[65536 + 256];    /* buffer for file data */
-/*****************************************************************************/
+// parts of flashDevice that are timed, for --manifest summary
+enum { PHASE_ERASE, PHASE_WRITE, PHASE_VERIFY, PHASE_RUN, PHASES };
 
 /******************************************************************************
 * Function prototypes
 ******************************************************************************/
-static int parseRaw(char *hexfile, char* buffer, int *startAddr, int *endAddr);
-static int parseIntelHex(char *hexfile, char* buffer, int *startAddr, int *endAddr); /* taken from bootloadHID example from obdev */
-static int parseUntilColon(FILE *fp); /* taken from bootloadHID example from obdev */
-static int parseHex(FILE *fp, int numDigits); /* taken from bootloadHID example from obdev */
+static int connectSimulated(micronucleus** devices, int count);
+static int flashDevice(micronucleus** device);
+static int reconnectDevice(micronucleus** device);
+static int flashManifest(char* manifest, int file_type, int simulate);
+static int entryMightMatch(micronucleus_entry* entry, const char* selector);
+static void printPhaseTimes(const char* name, long* times, int count);
+static void startPhase(void);
+static void endPhase(int phase);
+static void* flashThread(void* job);
+static void* parseThread(void* job);
+static micronucleus_image* loadFile(const char* file, int file_type);
+static void printDevice(const char* format, ...);
 static void printProgress(float progress);
+#ifdef MICRONUCLEUS_ASYNC
+static void printAsyncProgress(int device, const char* step, float progress);
+#endif
 static void setProgressData(char* friendly, int step);
-static int progress_step = 0; // current step
+static __thread int progress_step = 0; // current step
 static int progress_total_steps = 0; // total steps for upload
-static char* progress_friendly_name; // name of progress section
+static __thread char* progress_friendly_name; // name of progress section
+static __thread int progress_device = 0; // number of device when flashing several, otherwise 0
 static int dump_progress = 0; // output computer friendly progress info
 static int use_ansi = 0; // output ansi control character stuff
 static int timeout = 0; // 
+static int run = 0; // start program when done
+static int verify = 0; // check program after writing
+static int setup_write = 0; // send page data in SETUP packets, if device supports it
+static unsigned int sim_features = 0; // optional features simulated devices have
+static micronucleus_image* program = NULL; // what flashDevice writes
+static int endAddress = 0; // end of program, or 0 if none
+static char* device_selector = NULL; // location or serial number of device to use, or NULL for any
+static __thread long phase_time[PHASES]; // milliseconds each phase took, or -1 if skipped
+static __thread unsigned long phase_start;
+static pthread_mutex_t reconnect_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// one line of --manifest: device to flash and what to flash it with
+typedef struct {
+  char selector[32];  // device location or serial number, or "*" for any device
+  char* file;
+  micronucleus_image* program; // shared with earlier entries for same file
+  int end;
+  int result;         // -1 until flashed
+  long times[PHASES]; // phase_time after flashing
+} manifest_entry;
+
+// file read into program by its own thread, while waiting for devices
+typedef struct {
+  char* file;
+  int file_type;
+  int result;
+} parse_job;
+
+// one device being flashed by its own thread
+typedef struct {
+  micronucleus* device;
+  int number;
+  int result;
+} flash_job;
 /*****************************************************************************/
 
 /******************************************************************************
@@ -60,16 +113,23 @@ static int timeout = 0; //
 ******************************************************************************/
 int main(int argc, char **argv) {
   int res;
+  int i;
   char *file = NULL;
   micronucleus *my_device = NULL;
+  micronucleus *devices[MAX_DEVICES];
+  int device_count = 0;
 
   // parse arguments
-  int run = 0;
   int file_type = FILE_TYPE_INTEL_HEX;
   int arg_pointer = 1;
-  char* usage = "usage: micronucleus [--run] [--dump-progress] [--type intel-hex|raw] [--no-ansi] [--timeout integer] filename";
+  char *dump_file = NULL;
+  char *manifest = NULL;
+  int max_devices = 1; // connect to at most this many
+  int wanted_devices = 1; // wait until this many are connected
+  int simulate = 0; // use simulated devices rather than real ones
+  char* usage = "usage: micronucleus [--run] [--verify] [--dump filename] [--device selector] [--all | --count integer] [--manifest filename] [--simulate] [--sim-features integer] [--dump-progress] [--setup-write] [--type intel-hex|raw] [--no-ansi] [--timeout integer] filename";
   progress_step = 0;
-  progress_total_steps = 5; // steps: waiting, connecting, parsing, erasing, writing, (running)?
+  progress_total_steps = 5; // steps: waiting, connecting, parsing, erasing, writing, (verifying)?, (running)?
   dump_progress = 0;
   timeout = 0; // no timeout by default
   //#if defined(WIN)
@@ -82,6 +142,58 @@ int main(int argc, char **argv) {
     if (strcmp(argv[arg_pointer], "--run") == 0) {
       run = 1;
       progress_total_steps += 1;
+    } else if (strcmp(argv[arg_pointer], "--verify") == 0) {
+      verify = 1;
+      progress_total_steps += 1;
+    } else if (strcmp(argv[arg_pointer], "--dump") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc) {
+        printf("No filename given for --dump option\n");
+        return EXIT_FAILURE;
+      }
+      dump_file = argv[arg_pointer];
+    } else if (strcmp(argv[arg_pointer], "--device") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc) {
+        printf("No location or serial number given for --device option\n");
+        return EXIT_FAILURE;
+      }
+      device_selector = argv[arg_pointer];
+    } else if (strcmp(argv[arg_pointer], "--all") == 0) {
+      max_devices = MAX_DEVICES;
+      wanted_devices = 1;
+    } else if (strcmp(argv[arg_pointer], "--count") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc || sscanf(argv[arg_pointer], "%d", &wanted_devices) != 1 ||
+          wanted_devices < 1 || wanted_devices > MAX_DEVICES) {
+        printf("Did not understand --count value\n");
+        return EXIT_FAILURE;
+      }
+      max_devices = wanted_devices;
+    } else if (strcmp(argv[arg_pointer], "--manifest") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc) {
+        printf("No filename given for --manifest option\n");
+        return EXIT_FAILURE;
+      }
+      manifest = argv[arg_pointer];
+    } else if (strcmp(argv[arg_pointer], "--simulate") == 0) {
+      simulate = 1;
+    } else if (strcmp(argv[arg_pointer], "--sim-features") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc || sscanf(argv[arg_pointer], "%i", (int*) &sim_features) != 1 ||
+          (sim_features & ~MICRONUCLEUS_SIM_FEATURES)) {
+        printf("Did not understand --sim-features value\n");
+        return EXIT_FAILURE;
+      }
+      
+      // same as firmware requires
+      if (((sim_features & MICRONUCLEUS_FEATURE_PATCH_PAGE) && !(sim_features & MICRONUCLEUS_FEATURE_ERASE_WRITE)) ||
+          ((sim_features & MICRONUCLEUS_FEATURE_RESUME) && !(sim_features & MICRONUCLEUS_FEATURE_STATUS))) {
+        printf("--sim-features patch (0x200) needs erase on write (0x10), and resume (0x800) needs status (0x2)\n");
+        return EXIT_FAILURE;
+      }
+      simulate = 1;
     } else if (strcmp(argv[arg_pointer], "--type") == 0) {
       arg_pointer += 1;
       if (strcmp(argv[arg_pointer], "intel-hex") == 0) {
@@ -99,8 +211,34 @@ int main(int argc, char **argv) {
       puts("                           bytes (intel hex is default)");
       puts("          --dump-progress: Output progress data in computer-friendly form");
       puts("                           for driving GUIs");
+      puts("            --setup-write: Send page data in SETUP packets, if device");
+      puts("                           supports it. Each packet waits a USB frame,");
+      puts("                           so time it first; it's often slower");
       puts("                    --run: Ask bootloader to run the program when finished");
       puts("                           uploading provided program");
+      puts("                 --verify: Check program was written correctly, by");
+      puts("                           comparing CRC calculated by device. Devices");
+      puts("                           that can't are left alone and it fails");
+      puts("        --dump [filename]: Save program on device to intel hex file,");
+      puts("                           instead of uploading");
+      puts("      --device [selector]: Only use device at bus/device location, or");
+      puts("                           with serial number");
+      puts("                    --all: Flash every device plugged in, all at once");
+      puts("        --count [integer]: Wait for this many devices, then flash them all");
+      puts("                           at once");
+      puts("    --manifest [filename]: Flash each device listed in file, one per line");
+      puts("                           as \"device filename\", device being bus/device");
+      puts("                           location, serial number or \"*\" for any,");
+      puts("                           then print throughput and timing summary");
+      puts("               --simulate: Upload to simulated devices with realistic USB");
+      puts("                           and flash timing, to measure upload speed");
+      puts(" --sim-features [integer]: Give simulated devices these optional features,");
+      puts("                           as MICRONUCLEUS_FEATURE_* bits: 0x1 setup write,");
+      puts("                           0x2 status, 0x4 skip blank pages, 0x8 erase");
+      puts("                           range, 0x10 erase on write, 0x20 chunked erase,");
+      puts("                           0x40 page CRC, 0x80 image CRC, 0x100 read flash,");
+      puts("                           0x200 patch page, 0x400 compress, 0x800 resume.");
+      puts("                           Implies --simulate");
       //#ifndef WIN
       puts("                --no-ansi: Don't use ANSI in terminal output");
       //#endif
@@ -110,6 +248,8 @@ int main(int argc, char **argv) {
       return EXIT_SUCCESS;
     } else if (strcmp(argv[arg_pointer], "--dump-progress") == 0) {
       dump_progress = 1;
+    } else if (strcmp(argv[arg_pointer], "--setup-write") == 0) {
+      setup_write = 1;
     } else if (strcmp(argv[arg_pointer], "--no-ansi") == 0) {
       use_ansi = 0;
     } else if (strcmp(argv[arg_pointer], "--timeout") == 0) {
@@ -130,42 +270,104 @@ int main(int argc, char **argv) {
     return EXIT_FAILURE;
   }
   
+  // nothing to do without something to upload, run or dump to
+  if (!file && !run && !dump_file && !manifest) {
+    puts(usage);
+    return EXIT_FAILURE;
+  }
+  
+  if (dump_file && max_devices > 1) {
+    printf("--dump can only be used with one device\n");
+    return EXIT_FAILURE;
+  }
+  
+  if (manifest) {
+    if (dump_file || max_devices > 1) {
+      printf("--manifest can't be used with --dump, --all or --count\n");
+      return EXIT_FAILURE;
+    }
+    return flashManifest(manifest, file_type, simulate);
+  }
+  
+  if (dump_file) progress_total_steps = 3; // steps: waiting, connecting, reading
+  
+  // read file while waiting for devices, so a slow build piping it in on
+  // stdin costs nothing once one turns up
+  parse_job parse = { file, file_type, 0 };
+  pthread_t parser;
+  int parsing = 0;
+  if (!dump_file && file) {
+    parsing = 1;
+    if (pthread_create(&parser, NULL, parseThread, &parse) != 0) {
+      parseThread(&parse);
+      parsing = 0;
+    }
+  }
+  
   setProgressData("waiting", 1);
   if (dump_progress) printProgress(0.5);
-  printf("> Please plug in the device ... \n");
+  if (wanted_devices > 1) {
+    printf("> Please plug in the %d devices ... \n", wanted_devices);
+  } else {
+    printf("> Please plug in the device ... \n");
+  }
   printf("> Press CTRL+C to terminate the program.\n");
   
   
   time_t start_time, current_time;
   time(&start_time);
   
-  while (my_device == NULL) {
-    delay(100);
-    my_device = micronucleus_connect();
+  // devices are ready once they answer the info request connecting makes, so
+  // only need to look again when something is plugged in
+  while (1) {
+    // reconnect to all, in case one found last time went away
+    for (i = 0; i < device_count; i++) micronucleus_close(devices[i]);
+    if (simulate) {
+      device_count = connectSimulated(devices, wanted_devices);
+    } else {
+      device_count = micronucleus_connectMatching(devices, max_devices, device_selector);
+    }
+    
+    if (device_count >= wanted_devices) break;
     
     time(&current_time);
     if (timeout && start_time + timeout < current_time) {
       break;
     }
+    
+    micronucleus_waitChange(1000);
   }
   
-  if (my_device == NULL) {
+  if (device_count < wanted_devices) {
     printf("> Device search timed out\n");
     return EXIT_FAILURE;
   }
   
-  printf("> Device is found!\n");
+  if (max_devices > 1) {
+    printf("> %d device%s found!\n", device_count, device_count > 1 ? "s are" : " is");
+  } else {
+    printf("> Device is found!\n");
+  }
   
-  // wait for CONNECT_WAIT milliseconds with progress output
-  float wait = 0.0f;
   setProgressData("connecting", 2);
-  while (wait < CONNECT_WAIT) {
-    printProgress((wait / ((float) CONNECT_WAIT)) * 0.9f);
-    wait += 50.0f;
-    delay(50);
+  printProgress(0.0);
+  
+  if (max_devices > wanted_devices && !simulate) {
+    // pick up any that were plugged in at about the same time as the first
+    unsigned long settled = millis() + CONNECT_WAIT;
+    long left;
+    while ((left = (long) (settled - millis())) > 0 && micronucleus_waitChange(left)) {
+      for (i = 0; i < device_count; i++) micronucleus_close(devices[i]);
+      device_count = micronucleus_connectMatching(devices, max_devices, device_selector);
+    }
+    if (device_count == 0) {
+      printf("> Device went away\n");
+      return EXIT_FAILURE;
+    }
+    printf("> Flashing %d device%s\n", device_count, device_count > 1 ? "s" : "");
   }
   
-  //my_device = micronucleus_connect();
+  my_device = devices[0];
   printProgress(1.0);
     
   // if (my_device->page_size == 64) {
@@ -182,236 +384,660 @@ int main(int argc, char **argv) {
   printf("> Whole page count: %d\n", my_device->pages);
   printf("> Erase function sleep duration: %dms\n", my_device->erase_sleep);
   
+  if (dump_file) {
+    unsigned int reset_addr = my_device->flash_size;
+    
+    printf("> Reading the memory ...\n");
+    setProgressData("reading", 3);
+    printProgress(0.0);
+    
+    if (!(my_device->features & MICRONUCLEUS_FEATURE_READ_FLASH)) {
+      printf(">> Device doesn't support reading flash\n");
+      return EXIT_FAILURE;
+    }
+    
+    // includes user reset vector relocated to end of flash
+    unsigned char* dataBuffer = malloc(reset_addr + 2);
+    if (!dataBuffer) {
+      printf(">> Out of memory reading flash\n");
+      return EXIT_FAILURE;
+    }
+    res = micronucleus_readFlash(my_device, 0, reset_addr + 2, dataBuffer, printProgress);
+    if (res != 0) {
+      free(dataBuffer);
+      printf(">> Flash read error %d has occured ...\n", res);
+      printf(">> Please unplug the device and restart the program.\n");
+      return EXIT_FAILURE;
+    }
+    
+    // undo reset vector patching so file can be uploaded again
+    unsigned int data = dataBuffer[reset_addr] + (dataBuffer[reset_addr + 1]<<8);
+    if (data != 0xFFFF) {
+      data = ((data + reset_addr/2) & 0x0FFF) | 0xC000;
+      dataBuffer[0] = data >> 0 & 0xff;
+      dataBuffer[1] = data >> 8 & 0xff;
+    }
+    
+    // leave out trailing blank flash
+    int end = reset_addr;
+    while (end > 0 && dataBuffer[end - 1] == 0xFF) end--;
+    
+    res = micronucleus_writeIntelHex(dump_file, dataBuffer, end);
+    free(dataBuffer);
+    if (res) return EXIT_FAILURE;
+    
+    printProgress(1.0);
+    printf(">> Saved %d bytes to %s\n", end, dump_file);
+    return EXIT_SUCCESS;
+  }
+  
   setProgressData("parsing", 3);
   printProgress(0.0);
-  memset(dataBuffer, 0xFF, sizeof(dataBuffer));
-  
-  if ( !file && run )
-    goto do_run;
+  if (parsing) pthread_join(parser, NULL);
   
-  int startAddress = 1, endAddress = 0;
-  if (file_type == FILE_TYPE_INTEL_HEX) {
-    if (parseIntelHex(file, dataBuffer, &startAddress, &endAddress)) {
+  if (file) {
+    if (parse.result && file_type == FILE_TYPE_INTEL_HEX) {
       printf("> Error loading or parsing hex file.\n");
       return EXIT_FAILURE;
-    }
-  } else if (file_type == FILE_TYPE_RAW) {
-    if (parseRaw(file, dataBuffer, &startAddress, &endAddress)) {
+    } else if (parse.result) {
       printf("> Error loading raw file.\n");
       return EXIT_FAILURE;
     }
+    
+    printProgress(1.0);
+
+    if (endAddress == 0) {
+      printf("> No data in input file, exiting.\n");
+      return EXIT_FAILURE;
+    }
   }
   
-  printProgress(1.0);
+  unsigned long flash_start = millis();
+  if (device_count == 1) {
+    res = flashDevice(&devices[0]);
+#ifdef MICRONUCLEUS_ASYNC
+  } else if (endAddress && !verify && !simulate) {
+    // drive all devices from this thread, rather than a thread each
+    int failed = 0;
+    
+    use_ansi = 0;
+    for (i = 0; i < device_count; i++) micronucleus_close(devices[i]);
+    
+    // async transfers send pages from a flat copy
+    unsigned char* flat = malloc(endAddress);
+    if (!flat) {
+      printf("> Out of memory\n");
+      return EXIT_FAILURE;
+    }
+    micronucleus_image_read(program, 0, flat, endAddress);
+    
+    int found = micronucleus_async_flashAll(flat, endAddress, device_count, run, printAsyncProgress, &failed);
+    free(flat);
+    if (found < device_count) failed += device_count - (found < 0 ? 0 : found);
+    
+    if (failed) {
+      printf(">> %d of %d devices failed\n", failed, device_count);
+    } else {
+      printf(">> All %d devices done\n", device_count);
+    }
+    res = failed ? EXIT_FAILURE : EXIT_SUCCESS;
+#endif
+  } else {
+    // each device gets its own thread, and its own lines of progress
+    pthread_t threads[MAX_DEVICES];
+    flash_job jobs[MAX_DEVICES];
+    int failed = 0;
+    
+    use_ansi = 0;
+    
+    for (i = 0; i < device_count; i++) {
+      jobs[i].device = devices[i];
+      jobs[i].number = i + 1;
+      jobs[i].result = EXIT_FAILURE;
+      if (pthread_create(&threads[i], NULL, flashThread, &jobs[i]) != 0) {
+        printf("[%d] >> Couldn't start thread\n", i + 1);
+        jobs[i].number = 0;
+      }
+    }
+    
+    for (i = 0; i < device_count; i++) {
+      if (jobs[i].number) pthread_join(threads[i], NULL);
+      if (jobs[i].result != EXIT_SUCCESS) failed += 1;
+    }
+    
+    if (failed) {
+      printf(">> %d of %d devices failed\n", failed, device_count);
+    } else {
+      printf(">> All %d devices done\n", device_count);
+    }
+    res = failed ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+  
+  if (simulate) printf("> Flashing took %lums\n", millis() - flash_start);
+  
+  if (res == EXIT_SUCCESS) printf(">> Micronucleus done. Thank you!\n");
+  
+  return res;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+// Connects to count new simulated devices
+static int connectSimulated(micronucleus** devices, int count) {
+  int i;
+  
+  for (i = 0; i < count; i++) {
+    micronucleus_sim* sim = micronucleus_sim_new();
+    if (sim) sim->features = sim_features;
+    
+    devices[i] = micronucleus_sim_connect(sim);
+    if (!devices[i]) break;
+  }
+  
+  return i;
+}
 
-  if (startAddress >= endAddress) {
-    printf("> No data in input file, exiting.\n");
+// Erases, writes, verifies and runs as requested. May reconnect to device.
+static int flashDevice(micronucleus** device) {
+  micronucleus *my_device = *device;
+  micronucleus_upload *upload;
+  unsigned char command;
+  int res, i;
+  
+  for (i = 0; i < PHASES; i++) phase_time[i] = -1;
+  
+  if (!endAddress)
+    goto do_run;
+  
+  if ((unsigned int) endAddress > my_device->flash_size) {
+    printDevice("> Program file is %d bytes too big for the bootloader!\n", endAddress - my_device->flash_size);
     return EXIT_FAILURE;
   }
   
-  if (endAddress > my_device->flash_size) {
-    printf("> Program file is %d bytes too big for the bootloader!\n", endAddress - my_device->flash_size);
+  // rather than upload something that can't then be checked as asked
+  if (verify && !(my_device->features & MICRONUCLEUS_FEATURE_IMAGE_CRC)) {
+    printDevice("> Device doesn't support verifying, so nothing was uploaded.\n");
+    printDevice("> Leave out --verify to upload without checking.\n");
     return EXIT_FAILURE;
   }
   
   setProgressData("erasing", 4);
-  printf("> Erasing the memory ...\n");
-  res = micronucleus_eraseFlash(my_device, printProgress);
+  if (my_device->features & MICRONUCLEUS_FEATURE_ERASE_WRITE) {
+    // device erases each page just before writing it
+    printDevice("> Erasing pages as they're written ...\n");
+    res = 0;
+  } else {
+    printDevice("> Erasing the memory ...\n");
+    startPhase();
+    res = micronucleus_eraseFlash(my_device, endAddress, printProgress);
+    endPhase(PHASE_ERASE);
+  }
   
-  if (res == 1) { // erase disconnection bug workaround
+  if (res == 1 && progress_device) {
+    // others are connected too, so we can't tell which one is this
+    printDevice(">> Connection to device lost during erase!\n");
+    return EXIT_FAILURE;
+  } else if (res == 1) { // erase disconnection bug workaround
     printf(">> Eep! Connection to device lost during erase! Not to worry\n");
     printf(">> This happens on some computers - reconnecting...\n");
-    my_device = NULL;
-    
-    delay(CONNECT_WAIT);
+    micronucleus_close(my_device);
     
-    int deciseconds_till_reconnect_notice = 50; // notice after 5 seconds
-    while (my_device == NULL) {
-      delay(100);
-      my_device = micronucleus_connect();
-      deciseconds_till_reconnect_notice -= 1;
+    unsigned long lost_time = millis();
+    int noticed = 0;
+    while (micronucleus_connectMatching(&my_device, 1, device_selector) != 1) {
+      micronucleus_waitChange(1000);
       
-      if (deciseconds_till_reconnect_notice == 0) {
+      if (!noticed && millis() - lost_time > 5000) { // notice after 5 seconds
         printf(">> (!) Automatic reconnection not working. Unplug and reconnect\n");
         printf("   device usb connector, or reset it some other way to continue.\n");
+        noticed = 1;
       }
     }
+    *device = my_device;
     
-    printf(">> Reconnected! Continuing upload sequence...\n");
+    // Erase may have carried on while device was off the bus, but a new
+    // handle doesn't know that. Unless device says it finished, upload
+    // erases again, which a chunked erase continues where it stopped.
+    if ((my_device->features & MICRONUCLEUS_FEATURE_STATUS) &&
+        micronucleus_getStatus(my_device, &command, NULL) == 0 &&
+        command == 0x81) { // erased
+      my_device->erased = 1;
+      printf(">> Reconnected! Continuing upload sequence...\n");
+    } else {
+      printf(">> Reconnected! Erase may not have finished, erasing again...\n");
+    }
     
   } else if (res != 0) {
-    printf(">> Flash erase error %d has occured ...\n", res);
-    printf(">> Please unplug the device and restart the program.\n");
+    printDevice(">> Flash erase error %d has occured ...\n", res);
+    printDevice(">> Please unplug the device and restart the program.\n");
     return EXIT_FAILURE;
   }
   printProgress(1.0);
   
-  printf("> Starting to upload ...\n");
+  printDevice("> Starting to upload ...\n");
   setProgressData("writing", 5);
-  res = micronucleus_writeFlash(my_device, endAddress, dataBuffer, printProgress);
+  startPhase();
+  my_device->setup_write = setup_write;
+  upload = micronucleus_upload_beginImage(my_device, program, 0);
+  res = micronucleus_upload_finish(upload, printProgress);
+  
+  // a bad cable or the device dropping off the bus needn't mean starting over
+  for (i = 0; res != 0 && upload && i < RESUME_TRIES; i++) {
+    printDevice(">> Flash write error %d has occured, reconnecting ...\n", res);
+    if (reconnectDevice(device) != 0) break;
+    my_device = *device;
+    
+    if (micronucleus_upload_resume(upload, my_device))
+      printDevice(">> Reconnected! Resuming at address 0x%04X ...\n", upload->address);
+    else if (upload->phase == MICRONUCLEUS_UPLOAD_ERASING)
+      printDevice(">> Reconnected! Device lost its place, erasing and starting over ...\n");
+    else
+      printDevice(">> Reconnected! Device may have been reset, starting over ...\n");
+    res = micronucleus_upload_finish(upload, printProgress);
+  }
+  micronucleus_upload_cancel(upload);
+  
   if (res != 0) {
-    printf(">> Flash write error %d has occured ...\n", res);
-    printf(">> Please unplug the device and restart the program.\n");
+    printDevice(">> Flash write error %d has occured ...\n", res);
+    printDevice(">> Please unplug the device and restart the program.\n");
     return EXIT_FAILURE;
   }
+  endPhase(PHASE_WRITE);
   
+  if (verify) {
+    printDevice("> Verifying ...\n");
+    setProgressData("verifying", 6);
+    printProgress(0.0);
+
+    startPhase();
+    res = micronucleus_verifyImage(my_device, program);
+    if (res == 1) {
+      printDevice(">> Program in flash doesn't match file!\n");
+      return EXIT_FAILURE;
+    } else if (res != 0) {
+      printDevice(">> Verify error %d has occured ...\n", res);
+      printDevice(">> Please unplug the device and restart the program.\n");
+      return EXIT_FAILURE;
+    }
+    endPhase(PHASE_VERIFY);
+
+    printProgress(1.0);
+  }
+
 do_run:
   if (run) {
     
-    printf("> Starting the user app ...\n");
-    setProgressData("running", 6);
+    printDevice("> Starting the user app ...\n");
+    setProgressData("running", progress_total_steps);
     printProgress(0.0);
     
+    startPhase();
     res = micronucleus_startApp(my_device);
     
     if (res != 0) {
-      printf(">> Run error %d has occured ...\n", res);
-      printf(">> Please unplug the device and restart the program. \n");
+      printDevice(">> Run error %d has occured ...\n", res);
+      printDevice(">> Please unplug the device and restart the program. \n");
       return EXIT_FAILURE;
     }
+    endPhase(PHASE_RUN);
     
     printProgress(1.0);
   }
   
-  printf(">> Micronucleus done. Thank you!\n");
-  
   return EXIT_SUCCESS;
 }
-/******************************************************************************/
 
-/******************************************************************************/
-static void printProgress(float progress) {
-  static int last_step;
-  static int last_integer_total_progress;
+// Replaces device with a new connection to it, once it's back on the bus.
+// Returns 0 for success, 1 if it didn't come back.
+static int reconnectDevice(micronucleus** device) {
+  micronucleus *found;
+  unsigned long lost_time = millis();
+  const char *selector = device_selector; // NULL for any
+  int res;
   
-  if (dump_progress) {
-    printf("{status:\"%s\",step:%d,steps:%d,progress:%f}\n", progress_friendly_name, progress_step, progress_total_steps, progress);
-  } else {
-    if (last_step == progress_step && use_ansi) {
-      #ifndef WIN
-        printf("\033[1F\033[2K"); // move cursor to previous line and erase last update in this progress sequence
-      #else
-        printf("\r"); // return carriage to start of line so we can type over existing text
-      #endif
-    }
-    
-    float total_progress = ((float) progress_step - 1.0f) / (float) progress_total_steps;
-    total_progress += progress / (float) progress_total_steps;
-    int integer_total_progress = total_progress * 100.0f;
+  // serial number finds it wherever it turns up. Otherwise, when others are
+  // connected too, there's no telling which is this one, since it comes back
+  // with a new device number.
+  if ((*device)->serial[0]) {
+    selector = (*device)->serial;
+  } else if (progress_device) {
+    printDevice(">> Device has no serial number to find it among the others by\n");
+    return 1;
+  }
+  
+  while (1) {
+    // devices being flashed by other threads mustn't see bus scans overlap,
+    // but needn't wait while this one waits
+    pthread_mutex_lock(&reconnect_lock);
+    res = micronucleus_connectMatching(&found, 1, selector);
+    pthread_mutex_unlock(&reconnect_lock);
+    if (res == 1) break;
     
-    if (use_ansi || integer_total_progress >= last_integer_total_progress + 5) {
-      printf("%s: %d%% complete\n", progress_friendly_name, integer_total_progress);
-      last_integer_total_progress = integer_total_progress;
-    }
+    if (millis() - lost_time > RECONNECT_WAIT) return 1;
+    micronucleus_waitChange(1000);
   }
   
-  last_step = progress_step;
+  micronucleus_close(*device);
+  *device = found;
+  return 0;
 }
 
-static void setProgressData(char* friendly, int step) {
-  progress_friendly_name = friendly;
-  progress_step = step;
+static void startPhase(void) {
+  phase_start = millis();
 }
-/******************************************************************************/
 
-/******************************************************************************/
-static int parseUntilColon(FILE *file_pointer) {
-  int character;
+static void endPhase(int phase) {
+  phase_time[phase] = millis() - phase_start;
+}
+
+static void* parseThread(void* arg) {
+  parse_job* job = arg;
   
-  do {
-    character = getc(file_pointer);
-  } while(character != ':' && character != EOF);
+  program = loadFile(job->file, job->file_type);
+  job->result = program == NULL;
+  if (program) endAddress = program->end;
   
-  return character;
+  return NULL;
 }
-/******************************************************************************/
-
-/******************************************************************************/
-static int parseHex(FILE *file_pointer, int num_digits) {
-  int iter;
-  char temp[9];
 
-  for(iter = 0; iter < num_digits; iter++) {
-    temp[iter] = getc(file_pointer);
+// Reads file into a new image. Returns NULL for fail.
+static micronucleus_image* loadFile(const char* file, int file_type) {
+  micronucleus_image* image = micronucleus_image_new();
+  int res = 1;
+  
+  if (!image) {
+    printf("> Out of memory reading %s\n", file);
+    return NULL;
+  }
+  
+  if (file_type == FILE_TYPE_INTEL_HEX) {
+    res = micronucleus_loadIntelHex(file, image);
+  } else if (file_type == FILE_TYPE_RAW) {
+    res = micronucleus_loadRaw(file, image);
   }
-  temp[iter] = 0;
   
-  return strtol(temp, NULL, 16);
+  if (res) {
+    micronucleus_image_free(image);
+    return NULL;
+  }
+  return image;
+}
+
+static void* flashThread(void* arg) {
+  flash_job* job = arg;
+  
+  progress_device = job->number;
+  job->result = flashDevice(&job->device);
+  
+  return NULL;
 }
 /******************************************************************************/
 
 /******************************************************************************/
-static int parseIntelHex(char *hexfile, char* buffer, int *startAddr, int *endAddr) {
-  int address, base, d, segment, i, lineLen, sum;
-  FILE *input;
+// Flashes devices listed in manifest as they turn up, one at a time, then
+// prints how fast that went
+static int flashManifest(char* manifest, int file_type, int simulate) {
+  manifest_entry* entries = NULL;
+  micronucleus_entry listed[MAX_DEVICES];
+  micronucleus* device;
+  char finished[MAX_DEVICES][32]; // locations of devices flashed, until they leave the bus
+  char line[1024], file[1024];
+  int count = 0, left, done = 0, failed = 0, listed_count, finished_count = 0, flashed, i, j, k;
+  unsigned long first_start = 0, last_end = 0, start;
+  time_t start_time, current_time;
+  FILE* input;
   
-  input = strcmp(hexfile, "-") == 0 ? stdin : fopen(hexfile, "r");
+  input = fopen(manifest, "r");
   if (input == NULL) {
-    printf("> Error opening %s: %s\n", hexfile, strerror(errno));
-    return 1;
+    printf("> Error opening %s: %s\n", manifest, strerror(errno));
+    return EXIT_FAILURE;
   }
   
-  while (parseUntilColon(input) == ':') {
-    sum = 0;
-    sum += lineLen = parseHex(input, 2);
-    base = address = parseHex(input, 4);
-    sum += address >> 8;
-    sum += address;
-    sum += segment = parseHex(input, 2);  /* segment value? */
-    if (segment != 0) {   /* ignore lines where this byte is not 0 */
-      continue;
+  // read every file before starting, so devices don't wait on it
+  setProgressData("parsing", 3);
+  while (fgets(line, sizeof line, input)) {
+    manifest_entry* entry;
+    char selector[sizeof entry->selector];
+    
+    if (sscanf(line, " %31s %1023[^\r\n]", selector, file) != 2 || selector[0] == '#') continue;
+    
+    entry = realloc(entries, (count + 1) * sizeof(manifest_entry));
+    if (!entry) {
+      printf("> Out of memory reading %s\n", manifest);
+      return EXIT_FAILURE;
     }
+    entries = entry;
+    entry = &entries[count];
+    strcpy(entry->selector, selector);
+    entry->file = strdup(file);
+    entry->program = NULL;
+    entry->result = -1;
     
-    for (i = 0; i < lineLen; i++) {
-      d = parseHex(input, 2);
-      buffer[address++] = d;
-      sum += d;
+    for (i = 0; i < count; i++) {
+      if (strcmp(entries[i].file, file) == 0) {
+        entry->program = entries[i].program;
+        entry->end = entries[i].end;
+        break;
+      }
     }
     
-    sum += parseHex(input, 2);
-    if ((sum & 0xff) != 0) {
-      printf("> Warning: Checksum error between address 0x%x and 0x%x\n", base, address);
+    if (!entry->program) {
+      if (!entry->file) {
+        printf("> Out of memory reading %s\n", manifest);
+        return EXIT_FAILURE;
+      }
+      
+      entry->program = loadFile(file, file_type);
+      if (!entry->program || entry->program->end == 0) {
+        printf("> Error loading %s, or it has no data.\n", file);
+        return EXIT_FAILURE;
+      }
+      entry->end = entry->program->end;
     }
     
-    if(*startAddr > base) {
-      *startAddr = base;
+    count++;
+  }
+  fclose(input);
+  
+  if (count == 0) {
+    printf("> No devices listed in %s, exiting.\n", manifest);
+    return EXIT_FAILURE;
+  }
+  
+  printf("> %d device%s to flash. Please plug them in ...\n", count, count > 1 ? "s" : "");
+  printf("> Press CTRL+C to terminate the program.\n");
+  
+  use_ansi = 0;
+  time(&start_time);
+  
+  for (left = count; left > 0; ) {
+    listed_count = simulate ? 1 : micronucleus_list(listed, MAX_DEVICES);
+    
+    // a device unplugged since it was flashed may be back as another unit
+    for (k = finished_count; k-- > 0; ) {
+      for (i = 0; i < listed_count && strcmp(finished[k], listed[i].location) != 0; i++);
+      if (i == listed_count) strcpy(finished[k], finished[--finished_count]);
     }
-    if(*endAddr < address) {
-      *endAddr = address;
+    
+    flashed = 0;
+    for (i = 0; i < listed_count; i++) {
+      if (simulate) {
+        connectSimulated(&device, 1);
+      } else {
+        // each unit is flashed once, even if it's still in the bootloader,
+        // and devices no entry could be for aren't opened
+        for (k = 0; k < finished_count && strcmp(finished[k], listed[i].location) != 0; k++);
+        if (k < finished_count) continue;
+        
+        for (j = 0; j < count; j++) {
+          if (entries[j].result < 0 && entryMightMatch(&listed[i], entries[j].selector))
+            break;
+        }
+        if (j == count) continue;
+        
+        device = micronucleus_open(&listed[i]);
+      }
+      if (!device) continue;
+      
+      // first entry still to do that this device can take
+      for (j = 0; j < count; j++) {
+        if (entries[j].result < 0 && micronucleus_matches(device, entries[j].selector))
+          break;
+      }
+      
+      if (j < count) {
+        progress_device = j + 1;
+        program = entries[j].program;
+        endAddress = entries[j].end;
+        printDevice("> Flashing %s at %s\n", entries[j].file, device->location);
+        
+        start = millis();
+        if (!first_start) first_start = start;
+        entries[j].result = flashDevice(&device);
+        last_end = millis();
+        
+        if (!simulate && finished_count < MAX_DEVICES)
+          strcpy(finished[finished_count++], device->location);
+        
+        for (k = 0; k < PHASES; k++) entries[j].times[k] = phase_time[k];
+        if (entries[j].result == EXIT_SUCCESS) {
+          printDevice(">> Done in %lums\n", last_end - start);
+          done++;
+        } else {
+          failed++;
+        }
+        left--;
+        flashed++;
+      }
+      
+      micronucleus_close(device);
+    }
+    
+    time(&current_time);
+    if (timeout && start_time + timeout < current_time) {
+      break;
     }
+    
+    // the devices here have been done already, so wait for others
+    if (left > 0 && !flashed) micronucleus_waitChange(1000);
   }
+  progress_device = 0;
   
-  fclose(input);
-  return 0;
+  printf(">> %d of %d devices done, %d failed, %d not found\n", done, count, failed, left);
+  if (done && last_end > first_start) {
+    printf(">> %.1f units/hour over %.1fs\n", done * 3600000.0 / (last_end - first_start),
+           (last_end - first_start) / 1000.0);
+  }
+  
+  long* times = calloc((unsigned) count, sizeof(long));
+  if (times) {
+    const char* names[PHASES] = { "erase", "write", "verify", "run" };
+    
+    for (k = 0; k < PHASES; k++) {
+      int timed = 0;
+      for (j = 0; j < count; j++) {
+        if (entries[j].result == EXIT_SUCCESS && entries[j].times[k] >= 0)
+          times[timed++] = entries[j].times[k];
+      }
+      if (timed) printPhaseTimes(names[k], times, timed);
+    }
+    free(times);
+  }
+  
+  for (j = 0; j < count; j++) {
+    if (entries[j].result > 0) printf(">> Failed: [%d] %s %s\n", j + 1, entries[j].selector, entries[j].file);
+    if (entries[j].result < 0) printf(">> Not found: [%d] %s %s\n", j + 1, entries[j].selector, entries[j].file);
+  }
+  
+  return done == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Checks whether manifest selector could be for listed device, whose serial
+// number may not be known yet
+static int entryMightMatch(micronucleus_entry* entry, const char* selector) {
+  return strcmp(selector, "*") == 0 || strcmp(selector, entry->location) == 0 ||
+         (entry->has_serial && (!entry->serial[0] || strcmp(selector, entry->serial) == 0));
+}
+
+static int compareTimes(const void* a, const void* b) {
+  long x = *(const long*) a, y = *(const long*) b;
+  return x < y ? -1 : x > y;
+}
+
+// Prints median and 99th percentile (nearest rank) of times for one phase
+static void printPhaseTimes(const char* name, long* times, int count) {
+  qsort(times, count, sizeof(long), compareTimes);
+  printf(">> %-6s median %ldms, p99 %ldms\n", name, times[(count + 1) / 2 - 1],
+         times[(count * 99 + 99) / 100 - 1]);
 }
 /******************************************************************************/
 
 /******************************************************************************/
-static int parseRaw(char *filename, char* data_buffer, int *start_address, int *end_address) {
-  FILE *input;
+// printf, prefixed with device number when flashing several
+static void printDevice(const char* format, ...) {
+  char line[256];
+  va_list args;
   
-  input = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+  va_start(args, format);
+  vsnprintf(line, sizeof line, format, args);
+  va_end(args);
   
-  if (input == NULL) {
-    printf("> Error reading %s: %s\n", filename, strerror(errno));
-    return 1;
+  if (progress_device) {
+    printf("[%d] %s", progress_device, line);
+  } else {
+    fputs(line, stdout);
   }
+}
+
+static void printProgress(float progress) {
+  static __thread int last_step;
+  static __thread int last_integer_total_progress;
   
-  *start_address = 0;
-  *end_address = 0;
-  
-  // read in bytes from file
-  int byte = 0;
-  while (1) {
-    byte = getc(input);
-    if (byte == EOF) break;
+  if (dump_progress) {
+    if (progress_device) {
+      printf("{device:%d,status:\"%s\",step:%d,steps:%d,progress:%f}\n", progress_device, progress_friendly_name, progress_step, progress_total_steps, progress);
+    } else {
+      printf("{status:\"%s\",step:%d,steps:%d,progress:%f}\n", progress_friendly_name, progress_step, progress_total_steps, progress);
+    }
+  } else {
+    if (last_step == progress_step && use_ansi) {
+      #ifndef WIN
+        printf("\033[1F\033[2K"); // move cursor to previous line and erase last update in this progress sequence
+      #else
+        printf("\r"); // return carriage to start of line so we can type over existing text
+      #endif
+    }
+    
+    float total_progress = ((float) progress_step - 1.0f) / (float) progress_total_steps;
+    total_progress += progress / (float) progress_total_steps;
+    int integer_total_progress = total_progress * 100.0f;
     
-    *data_buffer = byte;
-    data_buffer += 1;
-    *end_address += 1;
+    if (use_ansi || integer_total_progress >= last_integer_total_progress + 5) {
+      printDevice("%s: %d%% complete\n", progress_friendly_name, integer_total_progress);
+      last_integer_total_progress = integer_total_progress;
+    }
   }
   
-  fclose(input);
-  return 0;
+  last_step = progress_step;
+}
+
+#ifdef MICRONUCLEUS_ASYNC
+static void printAsyncProgress(int device, const char* step, float progress) {
+  progress_device = device;
+  if (strcmp(step, "connecting") == 0) {
+    setProgressData("connecting", 2);
+  } else if (strcmp(step, "erasing") == 0) {
+    setProgressData("erasing", 4);
+  } else if (strcmp(step, "writing") == 0) {
+    setProgressData("writing", 5);
+  } else {
+    setProgressData("running", progress_total_steps);
+  }
+  printProgress(progress);
+}
+#endif
+
+static void setProgressData(char* friendly, int step) {
+  progress_friendly_name = friendly;
+  progress_step = step;
 }
-/******************************************************************************/
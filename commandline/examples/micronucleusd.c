@@ -0,0 +1,679 @@
+/*
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/******************************************************************************
+* Flashing daemon. Accepts jobs on a UNIX socket, one per connection, as a line
+*
+*   flash [--run] [--type intel-hex|raw] [--at location] /absolute/path/to/file
+*
+* and answers with lines as the job goes along:
+*
+*   queued
+*   flashing 001/004
+*   progress writing 42
+*   done                   or   error message
+*
+* Jobs are given to devices in the order they arrived as devices turn up. A job
+* with --at only goes to the device at that location, as bus/device number, or
+* with that serial number. A device left in the bootloader after a job only
+* gets jobs with --at until it leaves the bus, so the next board plugged in
+* gets the next job.
+* Parsed files are kept, so flashing the same file again doesn't read it again
+* unless it has changed.
+******************************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "micronucleus_lib.h"
+#include "micronucleus_image.h"
+#include "micronucleus_sim.h"
+#include "littleWire_util.h"
+
+#define FILE_TYPE_INTEL_HEX 1
+#define FILE_TYPE_RAW 2
+#define MAX_DEVICES 64 /* most devices looked at each time round */
+#define CACHED_IMAGES 8 /* parsed files kept for later jobs */
+#define REQUEST_TIMEOUT 5 /* seconds client has to send its request line */
+#define ERASE_RETRIES 3 /* times a job is retried after losing device during erase */
+#define LOST_TIMEOUT 10000 /* milliseconds device lost during erase has to turn up again */
+#define DEFAULT_SOCKET "/tmp/micronucleusd.sock"
+
+/******************************************************************************
+* Global definitions
+******************************************************************************/
+// parsed program file, shared by the cache and jobs using it
+typedef struct _image {
+  char path[PATH_MAX];
+  int type;
+  time_t mtime;             // of file when parsed
+  long mtime_nsec;          // so rebuilds in the same second are noticed
+  ino_t inode;
+  off_t size;
+  micronucleus_image* data; // pages file had data for
+  int end;                  // end of program in data
+  int users;                // cache and jobs holding it, guarded by queue_lock
+} image;
+
+// one request, waiting for a device
+typedef struct _job {
+  struct _job* next;
+  int client;               // socket progress and result go to
+  image* program;
+  char location[32];        // location or serial number of device to flash, or empty for any
+  int run;
+  int retries;
+  char lost[32];            // serial number of device lost during erase, which job waits for
+  unsigned long lost_until; // millis() job fails at if device lost during erase isn't back, or 0
+} job;
+
+static job* queue = NULL; // oldest first
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_changed = PTHREAD_COND_INITIALIZER;
+static image* cache[CACHED_IMAGES]; // guarded by cache_lock
+static int cache_next = 0; // slot replaced next
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static char finished[MAX_DEVICES][32]; // locations of devices jobs left in bootloader,
+static int finished_count = 0;         // only used by dispatcher
+static int simulate = 0; // use simulated devices rather than real ones
+static int progress_client; // where dispatcher sends progress
+static const char* progress_name;
+static int progress_percent;
+/*****************************************************************************/
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+static void reply(int client, const char* format, ...);
+static void releaseImage(image* program);
+static image* loadImage(const char* path, int type, char* error, int error_size);
+static image* loadCached(const char* path, int type, char* error, int error_size);
+static void handleClient(int client);
+static void* clientThread(void* client);
+static int selectorMightMatch(const char* selector, micronucleus_entry* entry);
+static int isFinished(const char* location);
+static void forgetGone(micronucleus_entry* entries, int count);
+static int jobMightWant(micronucleus_entry* entry);
+static job* takeJob(micronucleus* device);
+static void expireLost(void);
+static int flashJob(job* current, micronucleus* device);
+static void finishJob(job* current);
+static void* dispatch(void* unused);
+static void setProgress(int client, const char* name);
+static void printProgress(float progress);
+/*****************************************************************************/
+
+/******************************************************************************
+* Main function!
+******************************************************************************/
+int main(int argc, char **argv) {
+  char* socket_path = DEFAULT_SOCKET;
+  struct sockaddr_un address;
+  pthread_t dispatcher, reader;
+  pthread_attr_t detached;
+  int arg_pointer = 1;
+  int listener, client;
+  char* usage = "usage: micronucleusd [--socket path] [--simulate]";
+
+  while (arg_pointer < argc) {
+    if (strcmp(argv[arg_pointer], "--socket") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc) {
+        printf("No path given for --socket option\n");
+        return EXIT_FAILURE;
+      }
+      socket_path = argv[arg_pointer];
+    } else if (strcmp(argv[arg_pointer], "--simulate") == 0) {
+      simulate = 1;
+    } else if (strcmp(argv[arg_pointer], "--help") == 0 || strcmp(argv[arg_pointer], "-h") == 0) {
+      puts(usage);
+      puts("");
+      puts("  --socket [path]: Listen for jobs here (default " DEFAULT_SOCKET ")");
+      puts("       --simulate: Flash simulated devices, one each time a job waits");
+      puts("");
+      puts("Jobs are sent as one line per connection:");
+      puts("  flash [--run] [--type intel-hex|raw] [--at bus/device|serial] /path/to/file");
+      return EXIT_SUCCESS;
+    } else {
+      puts(usage);
+      return EXIT_FAILURE;
+    }
+
+    arg_pointer += 1;
+  }
+
+  if (strlen(socket_path) >= sizeof address.sun_path) {
+    printf("> Socket path %s is too long\n", socket_path);
+    return EXIT_FAILURE;
+  }
+
+  // clients that go away mustn't take the daemon with them
+  signal(SIGPIPE, SIG_IGN);
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    printf("> Error making socket: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  memset(&address, 0, sizeof address);
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_path);
+  unlink(socket_path); // left over from last time
+
+  if (bind(listener, (struct sockaddr*) &address, sizeof address) != 0 || listen(listener, 16) != 0) {
+    printf("> Error listening on %s: %s\n", socket_path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (pthread_create(&dispatcher, NULL, dispatch, NULL) != 0) {
+    printf("> Error starting dispatcher\n");
+    return EXIT_FAILURE;
+  }
+
+  pthread_attr_init(&detached);
+  pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+
+  printf("> Waiting for jobs on %s\n", socket_path);
+  fflush(stdout);
+
+  while (1) {
+    client = accept(listener, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR) continue;
+      printf("> Error accepting job: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+    // each client sends its request on its own thread, so one that stalls
+    // doesn't hold up the others
+    if (pthread_create(&reader, &detached, clientThread, (void*) (intptr_t) client) != 0)
+      handleClient(client);
+  }
+
+  return EXIT_SUCCESS;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+// Sends line to client, ignoring failure since it may have gone away
+static void reply(int client, const char* format, ...) {
+  char line[256];
+  va_list args;
+  int length;
+
+  va_start(args, format);
+  length = vsnprintf(line, sizeof line - 1, format, args);
+  va_end(args);
+
+  if (length < 0) return;
+  if (length > (int) sizeof line - 2) length = sizeof line - 2;
+  line[length++] = '\n';
+
+  if (write(client, line, length) < 0) return;
+}
+
+static void releaseImage(image* program) {
+  int unused;
+
+  pthread_mutex_lock(&queue_lock);
+  unused = --program->users == 0;
+  pthread_mutex_unlock(&queue_lock);
+
+  if (unused) {
+    micronucleus_image_free(program->data);
+    free(program);
+  }
+}
+
+#if defined MAC_OS
+  #define MTIME_NSEC(status) ((status).st_mtimespec.tv_nsec)
+#else
+  #define MTIME_NSEC(status) ((status).st_mtim.tv_nsec)
+#endif
+
+// Returns parsed file, from cache if it hasn't changed since. Caller gets a
+// reference, released with releaseImage().
+static image* loadImage(const char* path, int type, char* error, int error_size) {
+  image* program;
+
+  pthread_mutex_lock(&cache_lock);
+  program = loadCached(path, type, error, error_size);
+  pthread_mutex_unlock(&cache_lock);
+
+  return program;
+}
+
+// loadImage, with cache_lock held
+static image* loadCached(const char* path, int type, char* error, int error_size) {
+  struct stat status;
+  image* program;
+  int i;
+
+  if (stat(path, &status) != 0) {
+    snprintf(error, error_size, "%s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  for (i = 0; i < CACHED_IMAGES; i++) {
+    program = cache[i];
+    if (program && program->type == type && strcmp(program->path, path) == 0 &&
+        program->mtime == status.st_mtime && program->mtime_nsec == MTIME_NSEC(status) &&
+        program->inode == status.st_ino && program->size == status.st_size) {
+      pthread_mutex_lock(&queue_lock);
+      program->users++;
+      pthread_mutex_unlock(&queue_lock);
+      return program;
+    }
+  }
+
+  program = calloc(1, sizeof(image));
+  if (program) program->data = micronucleus_image_new();
+  if (!program || !program->data) {
+    free(program);
+    snprintf(error, error_size, "out of memory");
+    return NULL;
+  }
+
+  strcpy(program->path, path);
+  program->type = type;
+  program->mtime = status.st_mtime;
+  program->mtime_nsec = MTIME_NSEC(status);
+  program->inode = status.st_ino;
+  program->size = status.st_size;
+
+  if (type == FILE_TYPE_INTEL_HEX) {
+    i = micronucleus_loadIntelHex(path, program->data);
+  } else {
+    i = micronucleus_loadRaw(path, program->data);
+  }
+  program->end = program->data->end;
+
+  if (i != 0 || program->end == 0) {
+    snprintf(error, error_size, i ? "can't load %s" : "no data in %s", path);
+    micronucleus_image_free(program->data);
+    free(program);
+    return NULL;
+  }
+
+  // one reference for cache, one for caller
+  program->users = 2;
+  if (cache[cache_next]) releaseImage(cache[cache_next]);
+  cache[cache_next] = program;
+  cache_next = (cache_next + 1) % CACHED_IMAGES;
+
+  return program;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+// Reads job from client and queues it, or answers with error and closes it
+static void handleClient(int client) {
+  struct timeval wait = { REQUEST_TIMEOUT, 0 };
+  char line[PATH_MAX + 128];
+  char error[PATH_MAX + 64];
+  char *next, *word;
+  int length = 0;
+  ssize_t got;
+  job* current;
+  job** tail;
+
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof wait);
+
+  while (length < (int) sizeof line - 1 && !memchr(line, '\n', length)) {
+    got = read(client, line + length, sizeof line - 1 - length);
+    if (got <= 0) break;
+    length += got;
+  }
+  line[length] = 0;
+
+  next = strchr(line, '\n');
+  if (!next) {
+    reply(client, "error request must be one line");
+    close(client);
+    return;
+  }
+  *next = 0;
+  if (next > line && next[-1] == '\r') next[-1] = 0;
+
+  current = calloc(1, sizeof(job));
+  if (!current) {
+    reply(client, "error out of memory");
+    close(client);
+    return;
+  }
+  current->client = client;
+
+  // options, then the rest of the line is the file, so it may have spaces
+  int type = FILE_TYPE_INTEL_HEX;
+  next = line;
+  word = strsep(&next, " ");
+  if (strcmp(word, "flash") != 0) {
+    reply(client, "error unknown request %s", word);
+    goto fail;
+  }
+
+  while (next && strncmp(next, "--", 2) == 0) {
+    word = strsep(&next, " ");
+    if (strcmp(word, "--run") == 0) {
+      current->run = 1;
+    } else if (strcmp(word, "--type") == 0 && next) {
+      word = strsep(&next, " ");
+      if (strcmp(word, "intel-hex") == 0) {
+        type = FILE_TYPE_INTEL_HEX;
+      } else if (strcmp(word, "raw") == 0) {
+        type = FILE_TYPE_RAW;
+      } else {
+        reply(client, "error unknown file type %s", word);
+        goto fail;
+      }
+    } else if (strcmp(word, "--at") == 0 && next) {
+      word = strsep(&next, " ");
+      if (strlen(word) >= sizeof current->location) {
+        reply(client, "error no device at %s", word);
+        goto fail;
+      }
+      strcpy(current->location, word);
+    } else {
+      reply(client, "error did not understand %s", word);
+      goto fail;
+    }
+  }
+
+  // relative paths would be taken from the daemon's directory, not the client's
+  if (!next || next[0] != '/') {
+    reply(client, "error file must be given as an absolute path");
+    goto fail;
+  }
+
+  current->program = loadImage(next, type, error, sizeof error);
+  if (!current->program) {
+    reply(client, "error %s", error);
+    goto fail;
+  }
+
+  reply(client, "queued");
+
+  pthread_mutex_lock(&queue_lock);
+  for (tail = &queue; *tail; tail = &(*tail)->next);
+  *tail = current;
+  pthread_cond_signal(&queue_changed);
+  pthread_mutex_unlock(&queue_lock);
+  return;
+
+fail:
+  free(current);
+  close(client);
+}
+
+static void* clientThread(void* client) {
+  handleClient((int) (intptr_t) client);
+  return NULL;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+// Checks whether selector could be for listed device, whose serial number may
+// not be known yet. Empty selector is any device.
+static int selectorMightMatch(const char* selector, micronucleus_entry* entry) {
+  return !selector[0] || strcmp(selector, entry->location) == 0 ||
+         (entry->has_serial && (!entry->serial[0] || strcmp(selector, entry->serial) == 0));
+}
+
+// Checks whether a job left device at location in the bootloader
+static int isFinished(const char* location) {
+  int i;
+
+  for (i = 0; i < finished_count; i++) {
+    if (strcmp(finished[i], location) == 0) return 1;
+  }
+
+  return 0;
+}
+
+// Forgets finished devices that are no longer listed, so whatever turns up at
+// their location next is a new device
+static void forgetGone(micronucleus_entry* entries, int count) {
+  int i, j;
+
+  for (i = finished_count; i-- > 0; ) {
+    for (j = 0; j < count && strcmp(finished[i], entries[j].location) != 0; j++);
+    if (j == count) strcpy(finished[i], finished[--finished_count]);
+  }
+}
+
+// Checks whether any job could be for listed device, so it's worth opening
+static int jobMightWant(micronucleus_entry* entry) {
+  int done = isFinished(entry->location);
+  job* next;
+  int wanted = 0;
+
+  pthread_mutex_lock(&queue_lock);
+  for (next = queue; next && !wanted; next = next->next) {
+    wanted = selectorMightMatch(next->location, entry) && selectorMightMatch(next->lost, entry) &&
+             !(done && !next->location[0]);
+  }
+  pthread_mutex_unlock(&queue_lock);
+
+  return wanted;
+}
+
+// Removes and returns oldest job device can take, or NULL if none. A device a
+// job already left in the bootloader only takes jobs that ask for it.
+static job* takeJob(micronucleus* device) {
+  int done = isFinished(device->location);
+  job** link;
+  job* found = NULL;
+
+  pthread_mutex_lock(&queue_lock);
+  for (link = &queue; *link; link = &(*link)->next) {
+    if (done && !(*link)->location[0]) continue;
+
+    if (micronucleus_matches(device, (*link)->location) &&
+        (!(*link)->lost[0] || micronucleus_matches(device, (*link)->lost))) {
+      found = *link;
+      *link = found->next;
+      found->next = NULL;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&queue_lock);
+
+  return found;
+}
+
+// Fails jobs whose device was lost during erase and hasn't turned up again
+static void expireLost(void) {
+  job** link;
+  job* expired;
+
+  while (1) {
+    expired = NULL;
+
+    pthread_mutex_lock(&queue_lock);
+    for (link = &queue; *link; link = &(*link)->next) {
+      if ((*link)->lost_until && (long) (millis() - (*link)->lost_until) >= 0) {
+        expired = *link;
+        *link = expired->next;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    if (!expired) return;
+
+    reply(expired->client, "error device lost during erase didn't come back");
+    printf("> %s: device lost during erase didn't come back\n", expired->program->path);
+    fflush(stdout);
+    finishJob(expired);
+  }
+}
+
+// Erases, writes and runs as job asks. Returns 0 when done, 1 when failed, and
+// 2 if device was lost during erase and job went back on queue for it.
+static int flashJob(job* current, micronucleus* device) {
+  image* program = current->program;
+  int res;
+
+  reply(current->client, "flashing %s", device->location);
+
+  if ((unsigned int) program->end > device->flash_size) {
+    reply(current->client, "error program is %d bytes too big for the bootloader",
+          program->end - device->flash_size);
+    return 1;
+  }
+
+  if (!(device->features & MICRONUCLEUS_FEATURE_ERASE_WRITE)) {
+    // otherwise device erases each page just before writing it
+    setProgress(current->client, "erasing");
+    res = micronucleus_eraseFlash(device, program->end, printProgress);
+
+    if (res == 1 && current->retries++ < ERASE_RETRIES) {
+      // erase disconnection bug; same device will turn up again, likely at a
+      // new device number, so try it next. With a serial number, only that
+      // device can take the job.
+      strcpy(current->lost, device->serial);
+      current->lost_until = millis() + LOST_TIMEOUT;
+      pthread_mutex_lock(&queue_lock);
+      current->next = queue;
+      queue = current;
+      pthread_mutex_unlock(&queue_lock);
+      return 2;
+    } else if (res != 0) {
+      reply(current->client, "error flash erase error %d", res);
+      return 1;
+    }
+  }
+
+  setProgress(current->client, "writing");
+  res = micronucleus_writeImage(device, program->data, printProgress);
+  if (res != 0) {
+    reply(current->client, "error flash write error %d", res);
+    return 1;
+  }
+
+  if (current->run) {
+    setProgress(current->client, "running");
+    res = micronucleus_startApp(device);
+    if (res != 0) {
+      reply(current->client, "error run error %d", res);
+      return 1;
+    }
+  }
+
+  reply(current->client, "done");
+  return 0;
+}
+
+static void finishJob(job* current) {
+  close(current->client);
+  releaseImage(current->program);
+  free(current);
+}
+
+// Gives queued jobs to devices as they turn up, flashing one device at a time
+// so looking for more doesn't disturb those being flashed. Only devices a job
+// might be for are opened.
+static void* dispatch(void* unused) {
+  micronucleus_entry entries[MAX_DEVICES];
+  micronucleus* device;
+  int count, flashed, i, res;
+  unsigned long start;
+  job* current;
+
+  (void) unused;
+
+  while (1) {
+    pthread_mutex_lock(&queue_lock);
+    while (!queue) pthread_cond_wait(&queue_changed, &queue_lock);
+    pthread_mutex_unlock(&queue_lock);
+
+    expireLost();
+
+    count = simulate ? 1 : micronucleus_list(entries, MAX_DEVICES);
+    if (!simulate) forgetGone(entries, count);
+
+    flashed = 0;
+    for (i = 0; i < count; i++) {
+      if (simulate) {
+        device = micronucleus_sim_connect(micronucleus_sim_new());
+      } else if (jobMightWant(&entries[i])) {
+        device = micronucleus_open(&entries[i]);
+      } else {
+        continue;
+      }
+      if (!device) continue;
+
+      current = takeJob(device);
+      if (current) {
+        start = millis();
+        res = flashJob(current, device);
+        printf("> %s: %s %s after %lums\n", device->location, current->program->path,
+               res == 0 ? "done" : res == 1 ? "failed" : "lost during erase", millis() - start);
+        fflush(stdout);
+        if (res != 2) {
+          // unless program is running, device stays here in the bootloader
+          if (!simulate && !(res == 0 && current->run) && !isFinished(device->location) &&
+              finished_count < MAX_DEVICES)
+            strcpy(finished[finished_count++], device->location);
+          finishJob(current);
+        }
+        flashed++;
+      }
+      micronucleus_close(device);
+    }
+
+    // devices that are here have nothing to do, so wait for others
+    if (!flashed) micronucleus_waitChange(1000);
+  }
+
+  return NULL;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+static void setProgress(int client, const char* name) {
+  progress_client = client;
+  progress_name = name;
+  progress_percent = -1;
+  printProgress(0.0);
+}
+
+// Sends progress of current step, in steps of 5%
+static void printProgress(float progress) {
+  int percent = (int) (progress * 20.0f) * 5;
+
+  if (percent == progress_percent) return;
+  progress_percent = percent;
+
+  reply(progress_client, "progress %s %d", progress_name, percent);
+}
+/******************************************************************************/
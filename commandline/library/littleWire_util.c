@@ -1,5 +1,9 @@
 #include <littleWire_util.h>
 
+#if defined LINUX
+	#include <errno.h>
+#endif
+
 /* Delay in miliseconds */
 void delay(unsigned int duration)
 {
@@ -12,3 +16,60 @@ void delay(unsigned int duration)
 		usleep(duration*1000);
 	#endif
 }
+
+/* Delay in microseconds */
+void delayMicroseconds(unsigned long duration)
+{
+	#if defined _WIN32 || defined _WIN64
+		// windows can only sleep whole milliseconds
+		Sleep((duration + 999) / 1000);
+	#else
+		struct timespec wait;
+		wait.tv_sec  = duration / 1000000;
+		wait.tv_nsec = duration % 1000000 * 1000;
+		nanosleep(&wait, NULL);
+	#endif
+}
+
+/* Miliseconds elapsed since an arbitrary fixed point */
+unsigned long millis(void)
+{
+	#if defined _WIN32 || defined _WIN64
+		return GetTickCount();
+	#else
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+	#endif
+}
+
+/* Microseconds elapsed since an arbitrary fixed point */
+unsigned long long micros(void)
+{
+	#if defined _WIN32 || defined _WIN64
+		LARGE_INTEGER now, frequency;
+		QueryPerformanceCounter(&now);
+		QueryPerformanceFrequency(&frequency);
+		return now.QuadPart * 1000000ULL / frequency.QuadPart;
+	#else
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+	#endif
+}
+
+/* Delay until micros() reaches deadline, however long the caller took */
+void delayUntil(unsigned long long deadline)
+{
+	#if defined LINUX
+		// absolute wakeup, so time spent getting here doesn't add to it
+		struct timespec until;
+		until.tv_sec  = deadline / 1000000;
+		until.tv_nsec = deadline % 1000000 * 1000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) { }
+	#else
+		unsigned long long now = micros();
+		if (deadline > now)
+			delayMicroseconds(deadline - now);
+	#endif
+}
@@ -5,9 +5,22 @@
     #include <windows.h>
 #else
     #include <unistd.h>
+    #include <time.h>
 #endif
 
 /* Delay in miliseconds */
 void delay(unsigned int duration);
 
+/* Delay in microseconds */
+void delayMicroseconds(unsigned long duration);
+
+/* Miliseconds elapsed since an arbitrary fixed point */
+unsigned long millis(void);
+
+/* Microseconds elapsed since an arbitrary fixed point */
+unsigned long long micros(void);
+
+/* Delay until micros() reaches deadline, however long the caller took */
+void delayUntil(unsigned long long deadline);
+
 #endif
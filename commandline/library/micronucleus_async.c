@@ -0,0 +1,250 @@
+/*
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/***************************************************************/
+/* Flashing several devices from one thread with libusb-1.0    */
+/***************************************************************/
+#include <string.h>
+#include <libusb.h>
+#include "micronucleus_async.h"
+#include "littleWire_util.h"
+
+enum { step_info, step_erase, step_write, step_run, step_done, step_failed };
+
+typedef struct {
+  micronucleus info; // device information, for preparing pages
+  libusb_device_handle *handle;
+  struct libusb_transfer *transfer;
+  unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + 256];
+  int number;
+  int step;
+  int busy;               // transfer is in progress
+  unsigned int address;  // of next page to write
+  unsigned long deadline; // millis() when device can take next request
+} async_device;
+
+// shared by all devices
+typedef struct {
+  const unsigned char *program;
+  unsigned int program_size;
+  int run;
+  micronucleus_async_callback progress;
+} async_job;
+
+static void LIBUSB_CALL async_complete(struct libusb_transfer *transfer);
+
+static int async_submit(async_device *dev, int in, int request, int value, int index,
+                        const unsigned char *data, int length) {
+  libusb_fill_control_setup(dev->buffer,
+                            (in ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT) |
+                            LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+                            request, value, index, length);
+  if (data) memcpy(dev->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+
+  libusb_fill_control_transfer(dev->transfer, dev->handle, dev->buffer, async_complete,
+                               dev, MICRONUCLEUS_ASYNC_TIMEOUT);
+  if (libusb_submit_transfer(dev->transfer) != 0) return -1;
+
+  dev->busy = 1;
+  return 0;
+}
+
+// Sends device its next request, once it's ready for it
+static void async_next(async_device *dev, async_job *job) {
+  unsigned char page_buffer[256];
+  unsigned int page_length;
+  int res = 0;
+
+  switch (dev->step) {
+  case step_info:
+    if (job->progress) job->progress(dev->number, "connecting", 0.0);
+    res = async_submit(dev, 1, 0, 0, 0, NULL, 7);
+    break;
+
+  case step_erase:
+    if (job->progress) job->progress(dev->number, "erasing", 0.0);
+    res = async_submit(dev, 1, 2, 0, 0, NULL, 0);
+    break;
+
+  case step_write:
+    // skip pages not in program
+    while (dev->address < dev->info.flash_size &&
+           !micronucleus_preparePage(&dev->info, dev->address, job->program_size, job->program,
+                                     page_buffer, &page_length))
+      dev->address += dev->info.page_size;
+
+    if (dev->address < dev->info.flash_size) {
+      if (job->progress) job->progress(dev->number, "writing", (float) dev->address / dev->info.flash_size);
+      res = async_submit(dev, 0, 1, page_length, dev->address, page_buffer, page_length);
+      break;
+    }
+
+    if (job->progress) job->progress(dev->number, "writing", 1.0);
+    dev->step = job->run ? step_run : step_done;
+    if (dev->step == step_done) return;
+    // fall through
+
+  case step_run:
+    if (job->progress) job->progress(dev->number, "running", 0.0);
+    res = async_submit(dev, 1, 4, 0, 0, NULL, 0);
+    break;
+  }
+
+  if (res != 0) dev->step = step_failed;
+}
+
+static void LIBUSB_CALL async_complete(struct libusb_transfer *transfer) {
+  async_device *dev = transfer->user_data;
+  unsigned long now = millis();
+
+  dev->busy = 0;
+
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    // device may leave bus before it answers
+    dev->step = dev->step == step_run ? step_done : step_failed;
+    return;
+  }
+
+  switch (dev->step) {
+  case step_info:
+    if (transfer->actual_length < 4) {
+      dev->step = step_failed;
+      return;
+    }
+    micronucleus_setInfo(&dev->info, libusb_control_transfer_get_data(transfer), transfer->actual_length);
+    dev->info.erased = 1;
+    dev->step = step_erase;
+    break;
+
+  case step_erase:
+    dev->deadline = now + dev->info.erase_sleep;
+    dev->address = 0;
+    dev->step = step_write;
+    break;
+
+  case step_write:
+    dev->deadline = now + dev->info.write_sleep;
+    dev->address += dev->info.page_size;
+    break;
+
+  case step_run:
+    dev->step = step_done;
+    break;
+  }
+}
+
+int micronucleus_async_flashAll(const unsigned char* program, unsigned int program_size,
+                                int max_devices, int run, micronucleus_async_callback progress,
+                                int* failed) {
+  libusb_context *context;
+  libusb_device **list;
+  async_device *devices;
+  async_job job;
+  int count = 0;
+  int active;
+  int i;
+
+  job.program = program;
+  job.program_size = program_size;
+  job.run = run;
+  job.progress = progress;
+  *failed = 0;
+
+  if (libusb_init(&context) != 0) return -1;
+
+  devices = calloc(max_devices, sizeof(async_device));
+  ssize_t n = libusb_get_device_list(context, &list);
+  if (!devices || n < 0) {
+    free(devices);
+    libusb_exit(context);
+    return -1;
+  }
+
+  for (i = 0; i < n && count < max_devices; i++) {
+    struct libusb_device_descriptor descriptor;
+    async_device *dev = &devices[count];
+
+    if (libusb_get_device_descriptor(list[i], &descriptor) != 0 ||
+        descriptor.idVendor != MICRONUCLEUS_VENDOR_ID ||
+        descriptor.idProduct != MICRONUCLEUS_PRODUCT_ID)
+      continue;
+
+    dev->info.version.major = (descriptor.bcdDevice >> 8) & 0xFF;
+    dev->info.version.minor = descriptor.bcdDevice & 0xFF;
+    if (dev->info.version.major > MICRONUCLEUS_MAX_MAJOR_VERSION)
+      continue;
+
+    if (libusb_open(list[i], &dev->handle) != 0)
+      continue;
+
+    dev->transfer = libusb_alloc_transfer(0);
+    if (!dev->transfer) {
+      libusb_close(dev->handle);
+      continue;
+    }
+
+    dev->number = ++count;
+    dev->step = step_info;
+    dev->deadline = millis();
+  }
+  libusb_free_device_list(list, 1);
+
+  // start each device's next request once its deadline passes, and wait for
+  // transfers to complete until the next deadline
+  do {
+    unsigned long now = millis();
+    long wait = 100;
+    active = 0;
+
+    for (i = 0; i < count; i++) {
+      async_device *dev = &devices[i];
+      long left = (long) (dev->deadline - now);
+
+      if (dev->step == step_done || dev->step == step_failed) continue;
+      active += 1;
+
+      if (dev->busy) continue;
+
+      if (left <= 0) {
+        async_next(dev, &job);
+      } else if (left < wait) {
+        wait = left;
+      }
+    }
+
+    if (active) {
+      struct timeval timeout;
+      timeout.tv_sec  = wait / 1000;
+      timeout.tv_usec = wait % 1000 * 1000;
+      libusb_handle_events_timeout_completed(context, &timeout, NULL);
+    }
+  } while (active);
+
+  for (i = 0; i < count; i++) {
+    if (devices[i].step == step_failed) *failed += 1;
+    libusb_free_transfer(devices[i].transfer);
+    libusb_close(devices[i].handle);
+  }
+
+  free(devices);
+  libusb_exit(context);
+
+  return count;
+}
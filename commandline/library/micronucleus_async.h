@@ -0,0 +1,56 @@
+#ifndef MICRONUCLEUS_ASYNC_H
+#define MICRONUCLEUS_ASYNC_H
+
+/*
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/********************************************************************************
+* Flashes many devices from one thread using libusb-1.0's asynchronous
+* transfers. Each device steps through info, erase, page writes and run on its
+* own, and the event loop waits out erase and write times for all of them at
+* once rather than sleeping for each. Only uses the basic protocol, so
+* optional device features are ignored.
+********************************************************************************/
+
+/********************************************************************************
+* Header files
+********************************************************************************/
+#include "micronucleus_lib.h"
+/*******************************************************************************/
+
+// longest a single request may take before device is given up on
+#define MICRONUCLEUS_ASYNC_TIMEOUT 2000
+
+// reports progress of one device; device is numbered from 1, step is
+// "connecting", "erasing", "writing" or "running"
+typedef void (*micronucleus_async_callback)(int device, const char* step, float progress);
+
+/********************************************************************************
+* Flash program to every attached device, up to max_devices of them
+*     run: start program on each device once it's written
+*     failed: set to number of devices that couldn't be flashed
+*     Returns: number of devices found, negative if libusb fails
+********************************************************************************/
+int micronucleus_async_flashAll(const unsigned char* program, unsigned int program_length,
+                                int max_devices, int run, micronucleus_async_callback progress,
+                                int* failed);
+/*******************************************************************************/
+
+#endif
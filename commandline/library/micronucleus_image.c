@@ -0,0 +1,357 @@
+/*
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/***************************************************************/
+/* Reading and writing program image files                     */
+/***************************************************************/
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "micronucleus_image.h"
+
+#define READ_BLOCK 65536 /* bytes files are first read in */
+
+// value of each hex digit character, -1 for anything else
+static const signed char hexDigit[256] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+/******************************************************************************/
+// Reads all of file in large blocks. Returns contents to free, or NULL for fail.
+static unsigned char* readFile(const char *filename, size_t *length) {
+  unsigned char *data = NULL, *more;
+  size_t size = 0, n;
+  FILE *input;
+  
+  if (filename == NULL) {
+    fprintf(stderr, "Error reading file: no filename given\n");
+    return NULL;
+  }
+  
+  input = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+  if (input == NULL) {
+    fprintf(stderr, "Error opening %s: %s\n", filename, strerror(errno));
+    return NULL;
+  }
+  
+  *length = 0;
+  do {
+    if (*length == size) {
+      size = size ? size * 2 : READ_BLOCK;
+      more = realloc(data, size);
+      if (more == NULL) {
+        fprintf(stderr, "Error reading %s: out of memory\n", filename);
+        free(data);
+        fclose(input);
+        return NULL;
+      }
+      data = more;
+    }
+    
+    n = fread(data + *length, 1, size - *length, input);
+    *length += n;
+  } while (n > 0);
+  
+  if (ferror(input)) {
+    fprintf(stderr, "Error reading %s: %s\n", filename, strerror(errno));
+    free(data);
+    data = NULL;
+  }
+  
+  fclose(input);
+  return data;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+// Decodes count bytes from twice as many hex digits. Returns 0 for success,
+// 1 if any aren't hex digits.
+static int decodeHex(const unsigned char *digits, unsigned char *bytes, int count) {
+  int i, high, low;
+  
+  for (i = 0; i < count; i++) {
+    high = hexDigit[digits[i*2]];
+    low  = hexDigit[digits[i*2 + 1]];
+    if ((high | low) < 0) return 1;
+    bytes[i] = high << 4 | low;
+  }
+  
+  return 0;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+micronucleus_image* micronucleus_image_new(void) {
+  return calloc(1, sizeof(micronucleus_image));
+}
+/******************************************************************************/
+
+/******************************************************************************/
+void micronucleus_image_free(micronucleus_image* image) {
+  unsigned int i;
+  
+  if (image == NULL) return;
+  
+  for (i = 0; i < MICRONUCLEUS_IMAGE_LIMIT / MICRONUCLEUS_IMAGE_BLOCK; i++)
+    free(image->blocks[i]);
+  free(image);
+}
+/******************************************************************************/
+
+/******************************************************************************/
+int micronucleus_image_store(micronucleus_image* image, unsigned int address,
+                             const unsigned char* data, unsigned int length) {
+  unsigned int start = address, end = address + length;
+  unsigned int n, chunk;
+  unsigned char **block;
+  
+  if (address > MICRONUCLEUS_IMAGE_LIMIT || length > MICRONUCLEUS_IMAGE_LIMIT - address) return 1;
+  if (length == 0) return 0;
+  
+  while (address < end) {
+    block = &image->blocks[address / MICRONUCLEUS_IMAGE_BLOCK];
+    if (*block == NULL) {
+      *block = malloc(MICRONUCLEUS_IMAGE_BLOCK);
+      if (*block == NULL) return 1;
+      memset(*block, 0xFF, MICRONUCLEUS_IMAGE_BLOCK);
+    }
+    
+    n = MICRONUCLEUS_IMAGE_BLOCK - address % MICRONUCLEUS_IMAGE_BLOCK;
+    if (n > end - address) n = end - address;
+    memcpy(*block + address % MICRONUCLEUS_IMAGE_BLOCK, data, n);
+    
+    for (chunk = address / MICRONUCLEUS_IMAGE_CHUNK; chunk <= (address + n - 1) / MICRONUCLEUS_IMAGE_CHUNK; chunk++)
+      image->dirty[chunk / 8] |= 1 << chunk % 8;
+    
+    address += n;
+    data += n;
+  }
+  
+  if (image->end == 0 || image->start > start) image->start = start;
+  if (image->end < end) image->end = end;
+  return 0;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+void micronucleus_image_read(const micronucleus_image* image, unsigned int address,
+                             unsigned char* buffer, unsigned int length) {
+  const unsigned char *block;
+  unsigned int n;
+  
+  while (length > 0) {
+    n = MICRONUCLEUS_IMAGE_BLOCK - address % MICRONUCLEUS_IMAGE_BLOCK;
+    if (n > length) n = length;
+    
+    block = address < MICRONUCLEUS_IMAGE_LIMIT ? image->blocks[address / MICRONUCLEUS_IMAGE_BLOCK] : NULL;
+    if (block)
+      memcpy(buffer, block + address % MICRONUCLEUS_IMAGE_BLOCK, n);
+    else
+      memset(buffer, 0xFF, n);
+    
+    address += n;
+    buffer += n;
+    length -= n;
+  }
+}
+/******************************************************************************/
+
+/******************************************************************************/
+int micronucleus_image_dirty(const micronucleus_image* image, unsigned int address, unsigned int length) {
+  unsigned int chunk;
+  
+  if (length == 0 || address >= image->end || address + length <= image->start) return 0;
+  if (address + length > image->end) length = image->end - address;
+  
+  for (chunk = address / MICRONUCLEUS_IMAGE_CHUNK; chunk <= (address + length - 1) / MICRONUCLEUS_IMAGE_CHUNK; chunk++) {
+    if (image->dirty[chunk / 8] & 1 << chunk % 8) return 1;
+  }
+  
+  return 0;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+int micronucleus_loadIntelHex(const char *hexfile, micronucleus_image* image) {
+  unsigned char record[5 + 255]; // count, address, type, data, checksum
+  unsigned char *data, *next, *end, *scan;
+  unsigned long base = 0, address;
+  unsigned int count, line, sum, i;
+  size_t length;
+  
+  data = readFile(hexfile, &length);
+  if (data == NULL) return 1;
+  end = data + length;
+  
+  for (next = data; (next = memchr(next, ':', end - next)) != NULL; ) {
+    next++;
+    
+    // count comes first, and says how long the rest is
+    if (end - next < 2 || decodeHex(next, record, 1)) goto bad_record;
+    count = record[0];
+    if (end - next < (5 + count) * 2 || decodeHex(next, record, 5 + count)) goto bad_record;
+    next += (5 + count) * 2;
+    
+    address = base + (record[1] << 8 | record[2]);
+    
+    for (sum = 0, i = 0; i < 5 + count; i++) sum += record[i];
+    if ((sum & 0xff) != 0) {
+      fprintf(stderr, "Warning: Checksum error between address 0x%lx and 0x%lx\n", address, address + count);
+    }
+    
+    switch (record[3]) {
+    case 0x00: // data
+      if (micronucleus_image_store(image, address, record + 4, count)) {
+        fprintf(stderr, "Error loading %s: data at 0x%lX is beyond 64 KB, or out of memory\n", hexfile, address);
+        free(data);
+        return 1;
+      }
+      break;
+    
+    case 0x01: // end of file
+      free(data);
+      return 0;
+    
+    case 0x02: // extended segment address
+    case 0x04: // extended linear address
+      if (count != 2) goto bad_record;
+      base = (unsigned long) (record[4] << 8 | record[5]) << (record[3] == 0x02 ? 4 : 16);
+      break;
+    
+    case 0x03: // start segment address
+    case 0x05: // start linear address; device always starts at 0
+      break;
+    
+    default:
+      goto bad_record;
+    }
+  }
+  
+  free(data);
+  return 0;
+  
+bad_record:
+  for (line = 1, scan = data; scan < next; scan++) line += *scan == '\n';
+  fprintf(stderr, "Error parsing %s: bad record on line %u\n", hexfile, line);
+  free(data);
+  return 1;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+int micronucleus_loadRaw(const char *filename, micronucleus_image* image) {
+  unsigned char *data;
+  size_t length;
+  int res = 0;
+  
+  data = readFile(filename, &length);
+  if (data == NULL) return 1;
+  
+  if (length > MICRONUCLEUS_IMAGE_LIMIT || micronucleus_image_store(image, 0, data, length)) {
+    fprintf(stderr, "Error reading %s: file too big, or out of memory\n", filename);
+    res = 1;
+  }
+  
+  free(data);
+  return res;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+int micronucleus_parseIntelHex(const char *hexfile, unsigned char* buffer, int *startAddr, int *endAddr) {
+  micronucleus_image* image = micronucleus_image_new();
+  int res = image == NULL || micronucleus_loadIntelHex(hexfile, image);
+  
+  if (res == 0 && image->end) {
+    micronucleus_image_read(image, image->start, buffer + image->start, image->end - image->start);
+    if (*startAddr > (int) image->start) *startAddr = image->start;
+    if (*endAddr < (int) image->end) *endAddr = image->end;
+  }
+  
+  micronucleus_image_free(image);
+  return res;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+int micronucleus_writeIntelHex(const char *hexfile, const unsigned char* buffer, int endAddr) {
+  int address, i, n, sum;
+  FILE *output;
+  
+  output = fopen(hexfile, "w");
+  if (output == NULL) {
+    fprintf(stderr, "Error opening %s: %s\n", hexfile, strerror(errno));
+    return 1;
+  }
+  
+  for (address = 0; address < endAddr; address += n) {
+    n = endAddr - address < 16 ? endAddr - address : 16;
+    
+    fprintf(output, ":%02X%04X00", n, address);
+    sum = n + (address >> 8) + address;
+    for (i = 0; i < n; i++) {
+      fprintf(output, "%02X", buffer[address + i]);
+      sum += buffer[address + i];
+    }
+    fprintf(output, "%02X\n", -sum & 0xff);
+  }
+  fprintf(output, ":00000001FF\n");
+  
+  if (fclose(output) != 0) {
+    fprintf(stderr, "Error writing %s: %s\n", hexfile, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+int micronucleus_parseRaw(const char *filename, unsigned char* data_buffer, int *start_address, int *end_address) {
+  micronucleus_image* image = micronucleus_image_new();
+  int res = image == NULL || micronucleus_loadRaw(filename, image);
+  
+  *start_address = 0;
+  *end_address = 0;
+  
+  if (res == 0) {
+    micronucleus_image_read(image, 0, data_buffer, image->end);
+    *end_address = image->end;
+  }
+  
+  micronucleus_image_free(image);
+  return res;
+}
+/******************************************************************************/
@@ -0,0 +1,123 @@
+#ifndef MICRONUCLEUS_IMAGE_H
+#define MICRONUCLEUS_IMAGE_H
+
+/*
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/********************************************************************************
+* Program image files, shared by the command line tool and the daemon
+********************************************************************************/
+// bytes image buffers need, covering a 16-bit address plus one record past it
+#define MICRONUCLEUS_IMAGE_SIZE (65536 + 256)
+
+// addresses an image can hold
+#define MICRONUCLEUS_IMAGE_LIMIT 65536
+
+// bytes allocated together, a multiple of every device's page size
+#define MICRONUCLEUS_IMAGE_BLOCK 256
+
+// bytes each dirty bit covers, the smallest device page size
+#define MICRONUCLEUS_IMAGE_CHUNK 32
+
+// program as the pages a file actually has data for
+typedef struct _micronucleus_image {
+  unsigned char *blocks[MICRONUCLEUS_IMAGE_LIMIT / MICRONUCLEUS_IMAGE_BLOCK]; // NULL if empty, otherwise 0xFF where file had nothing
+  unsigned char dirty[MICRONUCLEUS_IMAGE_LIMIT / MICRONUCLEUS_IMAGE_CHUNK / 8]; // bit set for each chunk file has data in
+  unsigned int start;       // lowest address with data
+  unsigned int end;         // one past the highest, 0 if image is empty
+} micronucleus_image;
+/*******************************************************************************/
+
+/********************************************************************************
+* Make an empty image
+*     Returns: image for success, NULL for fail
+********************************************************************************/
+micronucleus_image* micronucleus_image_new(void);
+/*******************************************************************************/
+
+/********************************************************************************
+* Free image and its pages. Does nothing if NULL.
+********************************************************************************/
+void micronucleus_image_free(micronucleus_image* image);
+/*******************************************************************************/
+
+/********************************************************************************
+* Put length bytes of data into image at address
+*     Returns: 0 for success, 1 if beyond MICRONUCLEUS_IMAGE_LIMIT or out of memory
+********************************************************************************/
+int micronucleus_image_store(micronucleus_image* image, unsigned int address,
+                             const unsigned char* data, unsigned int length);
+/*******************************************************************************/
+
+/********************************************************************************
+* Copy length bytes of image at address into buffer, 0xFF where it has nothing
+********************************************************************************/
+void micronucleus_image_read(const micronucleus_image* image, unsigned int address,
+                             unsigned char* buffer, unsigned int length);
+/*******************************************************************************/
+
+/********************************************************************************
+* Check whether file had data anywhere in length bytes at address
+*     Returns: 1 if it did, 0 if not
+********************************************************************************/
+int micronucleus_image_dirty(const micronucleus_image* image, unsigned int address, unsigned int length);
+/*******************************************************************************/
+
+/********************************************************************************
+* Read Intel HEX file into image. Extended segment and linear address records
+* are followed, start address records ignored, and reading stops at the end of
+* file record. "-" reads standard input.
+*     Returns: 0 for success, 1 for fail
+********************************************************************************/
+int micronucleus_loadIntelHex(const char *hexfile, micronucleus_image* image);
+/*******************************************************************************/
+
+/********************************************************************************
+* Read raw binary file into image at address 0. "-" reads standard input.
+*     Returns: 0 for success, 1 for fail
+********************************************************************************/
+int micronucleus_loadRaw(const char *filename, micronucleus_image* image);
+/*******************************************************************************/
+
+/********************************************************************************
+* Read Intel HEX file into buffer, which should already be filled with 0xFF,
+* as micronucleus_loadIntelHex.
+*     startAddr, endAddr: lowered and raised to cover the data read
+*     Returns: 0 for success, 1 for fail
+********************************************************************************/
+int micronucleus_parseIntelHex(const char *hexfile, unsigned char* buffer, int *startAddr, int *endAddr);
+/*******************************************************************************/
+
+/********************************************************************************
+* Read raw binary file into buffer. "-" reads standard input.
+*     startAddr, endAddr: set to the span of the data read
+*     Returns: 0 for success, 1 for fail
+********************************************************************************/
+int micronucleus_parseRaw(const char *filename, unsigned char* buffer, int *startAddr, int *endAddr);
+/*******************************************************************************/
+
+/********************************************************************************
+* Write first endAddr bytes of buffer as Intel HEX file
+*     Returns: 0 for success, 1 for fail
+********************************************************************************/
+int micronucleus_writeIntelHex(const char *hexfile, const unsigned char* buffer, int endAddr);
+/*******************************************************************************/
+
+#endif
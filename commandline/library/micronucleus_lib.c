@@ -25,73 +25,882 @@
 /***************************************************************/
 /* See the micronucleus_lib.h for the function descriptions/comments */
 /***************************************************************/
+#include <string.h>
 #include "micronucleus_lib.h"
 #include "littleWire_util.h"
 
-micronucleus* micronucleus_connect() {
-  micronucleus *nucleus = NULL;
-  struct usb_bus *busses;
-
-  // intialise usb and find micronucleus device
-  usb_init();
-  usb_find_busses();
-  usb_find_devices();
-
-  busses = usb_get_busses();
-  struct usb_bus *bus;
-  for (bus = busses; bus; bus = bus->next) {
-    struct usb_device *dev;
-
-    for (dev = bus->devices; dev; dev = dev->next) {
-      /* Check if this device is a micronucleus */
-      if (dev->descriptor.idVendor == MICRONUCLEUS_VENDOR_ID && dev->descriptor.idProduct == MICRONUCLEUS_PRODUCT_ID)  {
-        nucleus = malloc(sizeof(micronucleus));
-        nucleus->version.major = (dev->descriptor.bcdDevice >> 8) & 0xFF;
-        nucleus->version.minor = dev->descriptor.bcdDevice & 0xFF;
-
-fprintf( stderr, "%d %d\n", nucleus->version.major, nucleus->version.minor );
-
-        if (nucleus->version.major > MICRONUCLEUS_MAX_MAJOR_VERSION) {
-          fprintf(stderr, "Warning: device with unknown new version of Micronucleus detected.\n");
-          fprintf(stderr, "This tool doesn't know how to upload to this new device. Updates may be available.\n");
-          fprintf(stderr, "Device reports version as: %d.%d\n", nucleus->version.major, nucleus->version.minor);
-          return NULL;
+// Sends control request to device through its transport. Same arguments and
+// result as usb_control_msg().
+static int micronucleus_control(micronucleus* deviceHandle, int requesttype, int request,
+                                int value, int index, unsigned char* bytes, int size, int timeout) {
+  return deviceHandle->transport->control(deviceHandle->device, requesttype, request,
+                                          value, index, (char*) bytes, size, timeout);
+}
+
+micronucleus* micronucleus_attach(const micronucleus_transport* transport, void* device,
+                                  micronucleus_version version) {
+  unsigned char info[MICRONUCLEUS_INFO_SIZE];
+  int length = 0;
+
+  return micronucleus_attachInfo(transport, device, version, info, &length);
+}
+
+micronucleus* micronucleus_attachInfo(const micronucleus_transport* transport, void* device,
+                                      micronucleus_version version, unsigned char* info,
+                                      int* length) {
+  micronucleus *nucleus;
+
+  if (version.major > MICRONUCLEUS_MAX_MAJOR_VERSION) {
+    fprintf(stderr, "Warning: device with unknown new version of Micronucleus detected.\n");
+    fprintf(stderr, "This tool doesn't know how to upload to this new device. Updates may be available.\n");
+    fprintf(stderr, "Device reports version as: %d.%d\n", version.major, version.minor);
+    transport->close(device);
+    return NULL;
+  }
+
+  nucleus = malloc(sizeof(micronucleus));
+  if (!nucleus) {
+    transport->close(device);
+    return NULL;
+  }
+
+  nucleus->transport = transport;
+  nucleus->device = device;
+  nucleus->location[0] = 0;
+  nucleus->serial[0] = 0;
+  nucleus->version = version;
+  nucleus->setup_write = 0;
+
+  // get nucleus info (older firmware only sends the first 4 bytes)
+  if (*length == 0) {
+    *length = micronucleus_control(nucleus, 0xC0, 0, 0, 0, info, MICRONUCLEUS_INFO_SIZE,
+                                   MICRONUCLEUS_USB_TIMEOUT);
+    if (*length < 4) {
+      *length = 0;
+      micronucleus_close(nucleus);
+      return NULL;
+    }
+  }
+
+  micronucleus_setInfo(nucleus, info, *length);
+
+  return nucleus;
+}
+
+void micronucleus_setInfo(micronucleus* nucleus, const unsigned char* buffer, int length) {
+  nucleus->flash_size = (buffer[0]<<8) + buffer[1];
+  nucleus->page_size = buffer[2];
+  nucleus->pages = (nucleus->flash_size / nucleus->page_size);
+  if (nucleus->pages * nucleus->page_size < nucleus->flash_size) nucleus->pages += 1;
+  nucleus->write_sleep = buffer[3];
+  nucleus->erase_sleep = nucleus->write_sleep * nucleus->pages;
+  nucleus->features = 0;
+  nucleus->erased = 0;
+  if (length >= 6) nucleus->features = buffer[4] + (buffer[5]<<8);
+
+  // only non-blank pages take time to erase, plus a little for checking the rest
+  if ((nucleus->features & MICRONUCLEUS_FEATURE_SKIP_BLANK) && length >= 7)
+    nucleus->erase_sleep = nucleus->write_sleep * (buffer[6] + 1);
+}
+
+int micronucleus_matches(micronucleus* deviceHandle, const char* selector) {
+  if (!selector || !selector[0] || strcmp(selector, "*") == 0) return 1;
+
+  if (strcmp(selector, deviceHandle->location) == 0) return 1;
+
+  return deviceHandle->serial[0] && strcmp(selector, deviceHandle->serial) == 0;
+}
+
+void micronucleus_close(micronucleus* deviceHandle) {
+  if (!deviceHandle) return;
+
+  if (deviceHandle->device) deviceHandle->transport->close(deviceHandle->device);
+  free(deviceHandle);
+}
+
+int micronucleus_getStatus(micronucleus* deviceHandle, unsigned char* command, unsigned int* address) {
+  unsigned char buffer[3];
+  int res = micronucleus_control(deviceHandle, 0xC0, 5, 0, 0, buffer, 3, MICRONUCLEUS_STATUS_TIMEOUT);
+
+  if (res != 3) return res < 0 ? res : -1;
+
+  if (command) *command = buffer[0];
+  if (address) *address = buffer[1] + (buffer[2]<<8);
+
+  return 0;
+}
+
+// CRC16 as used by USB, matching usbCrc16() in the device
+static unsigned int micronucleus_crc16(const unsigned char* data, unsigned int length) {
+  unsigned int crc = 0xFFFF;
+  int bit;
+
+  while (length--) {
+    crc ^= *data++;
+    for (bit = 0; bit < 8; bit++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+  }
+
+  return ~crc & 0xFFFF;
+}
+
+// Reads reply to a request whose work the device does after the request that
+// started it, retrying while it's busy for up to twice the expected duration.
+// A read sent before then always gets another try, however long it took.
+static int micronucleus_readResult(micronucleus* deviceHandle, int request, unsigned char* buffer,
+                                   int length, unsigned int duration) {
+  unsigned long start = millis();
+  unsigned long polled;
+  int res;
+
+  do {
+    polled = millis();
+    res = micronucleus_control(deviceHandle, 0xC0, request, 0, 0, buffer, length, MICRONUCLEUS_STATUS_TIMEOUT);
+    if (res == length) return 0;
+
+    delay(1);
+  } while (polled - start < duration * 2);
+
+  return res < 0 ? res : -1;
+}
+
+int micronucleus_getPageCrcs(micronucleus* deviceHandle, unsigned int address, unsigned int count, unsigned int* crcs) {
+  unsigned char buffer[8];
+  int res;
+  unsigned int i;
+
+  while (count) {
+    // device does at most four per request
+    unsigned int n = count < 4 ? count : 4;
+
+    res = micronucleus_control(deviceHandle, 0xC0, 6, n, address, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+    if (res < 0) return res;
+
+    res = micronucleus_readResult(deviceHandle, 6, buffer, n * 2, deviceHandle->write_sleep);
+    if (res < 0) return res;
+
+    for (i = 0; i < n; i++)
+      *crcs++ = buffer[i*2] + (buffer[i*2+1]<<8);
+
+    address += n * deviceHandle->page_size;
+    count -= n;
+  }
+
+  return 0;
+}
+
+// True if pages must be erased as they're written
+static int micronucleus_eraseOnWrite(micronucleus* deviceHandle) {
+  return !deviceHandle->erased && (deviceHandle->features & MICRONUCLEUS_FEATURE_ERASE_WRITE);
+}
+
+// Run-length encodes page for device. Each record is a word with count in low
+// byte, followed by either that many words (high byte 0) or one word the
+// device fills that many times (high byte 1). Returns length of encoding.
+static unsigned int micronucleus_compressPage(const unsigned char* page_buffer, unsigned int page_length,
+                                              unsigned char* out) {
+  unsigned int i = 0;
+  unsigned int n = 0;
+  int literal = -1; // header of current list of words, if any
+
+  while (i < page_length) {
+    unsigned int run = 2;
+    while (i + run < page_length && run < 255 * 2 &&
+           page_buffer[i + run] == page_buffer[i] && page_buffer[i + run + 1] == page_buffer[i + 1])
+      run += 2;
+
+    if (run >= 3 * 2) {
+      // fill is shorter than listing three or more words
+      out[n++] = run / 2;
+      out[n++] = 1;
+      out[n++] = page_buffer[i];
+      out[n++] = page_buffer[i + 1];
+      literal = -1;
+      i += run;
+    } else {
+      if (literal < 0 || out[literal] == 255) {
+        literal = n;
+        out[n++] = 0;
+        out[n++] = 0;
+      }
+      out[literal]++;
+      out[n++] = page_buffer[i];
+      out[n++] = page_buffer[i + 1];
+      i += 2;
+    }
+  }
+
+  return n;
+}
+
+static int micronucleus_writePage(micronucleus* deviceHandle, unsigned int address,
+                                  const unsigned char* page_buffer, unsigned int page_length) {
+  int res;
+  unsigned int i;
+  unsigned int flags = 0;
+
+  if (micronucleus_eraseOnWrite(deviceHandle))
+    flags |= 1 << 8; // have device erase page just before writing it
+
+  if (deviceHandle->features & MICRONUCLEUS_FEATURE_COMPRESS) {
+    unsigned char compressed[page_length * 2];
+    unsigned int length = micronucleus_compressPage(page_buffer, page_length, compressed);
+
+    if (length < page_length) {
+      res = micronucleus_control(deviceHandle,
+             USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+             1,
+             page_length | flags | 2 << 8, address,
+             compressed, length,
+             MICRONUCLEUS_USB_TIMEOUT);
+      return res == (int) length ? (int) page_length : (res < 0 ? res : -1);
+    }
+  }
+
+  if (!(deviceHandle->features & MICRONUCLEUS_FEATURE_SETUP_WRITE) || !deviceHandle->setup_write) {
+    res = micronucleus_control(deviceHandle,
+           USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+           1,
+           page_length | flags, address,
+           (unsigned char*) page_buffer, page_length,
+           MICRONUCLEUS_USB_TIMEOUT);
+    return res;
+  }
+
+  // start page without a DATA stage, then send two words in each SETUP packet
+  res = micronucleus_control(deviceHandle,
+         USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+         1,
+         page_length | flags, address,
+         NULL, 0,
+         MICRONUCLEUS_USB_TIMEOUT);
+
+  for (i = 0; res == 0 && i < page_length; i += 4) {
+    res = micronucleus_control(deviceHandle,
+           USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+           3,
+           page_buffer[i+0] + (page_buffer[i+1]<<8),
+           page_buffer[i+2] + (page_buffer[i+3]<<8),
+           NULL, 0,
+           MICRONUCLEUS_USB_TIMEOUT);
+  }
+
+  return res == 0 ? (int) page_length : res;
+}
+
+// Fills patch with address and value of each word of page on device that
+// differs from expected. Returns its length, or 0 if writing whole page
+// would send less.
+static int micronucleus_diffPage(micronucleus* deviceHandle, unsigned int address,
+                                 unsigned char* expected, unsigned int page_length,
+                                 unsigned char* patch) {
+  unsigned char current[page_length];
+  unsigned int i;
+  unsigned int n = 0;
+
+  if (micronucleus_readFlash(deviceHandle, address, page_length, current, NULL) != 0)
+    return 0;
+
+  for (i = 0; i < page_length; i += 2) {
+    if (current[i] != expected[i] || current[i+1] != expected[i+1]) {
+      if (n + 4 >= page_length) return 0;
+
+      patch[n++] = (address + i) >> 0 & 0xff;
+      patch[n++] = (address + i) >> 8 & 0xff;
+      patch[n++] = expected[i];
+      patch[n++] = expected[i+1];
+    }
+  }
+
+  return n;
+}
+
+int micronucleus_preparePage(micronucleus* deviceHandle, unsigned int address, unsigned int program_size,
+                             const unsigned char* program, unsigned char* page_buffer, unsigned int* page_length_out) {
+  unsigned int page_length = deviceHandle->page_size;
+  unsigned int page_address; // address within this page when copying buffer
+  unsigned int userReset = program[1] * 0x100 + program[0];
+  unsigned char unused = 1;
+
+  // work around a bug in older bootloader versions
+  if (deviceHandle->version.major == 1 && deviceHandle->version.minor <= 2
+      && address / deviceHandle->page_size == deviceHandle->pages - 1) {
+    page_length = deviceHandle->flash_size % deviceHandle->page_size;
+  }
+  *page_length_out = page_length;
+
+  // copy in bytes from user program
+  for (page_address = 0; page_address < page_length; page_address += 1) {
+    if (address + page_address >= program_size) {
+      page_buffer[page_address] = 0xFF; // pad out remainder with unprogrammed bytes
+    } else {
+      unused = 0;
+      page_buffer[page_address] = program[address + page_address]; // load from user program
+    }
+  }
+
+  // later versions leave it to us to put rjmp to user code at end of flash
+  // (bootloader patches page 0 with its own vector)
+  if ( deviceHandle->version.major >= 2 )
+  {
+    if ( address >= deviceHandle->flash_size - deviceHandle->page_size )
+    {
+      // move user reset vector to end of last page
+      unsigned user_reset_addr = deviceHandle->flash_size;
+      unsigned data = (userReset + 0x1000 - user_reset_addr/2) & ~0x1000;
+      
+      page_buffer [user_reset_addr - address + 0] = data >> 0 & 0xff;
+      page_buffer [user_reset_addr - address + 1] = data >> 8 & 0xff;
+      unused = 0;
+    }
+  }
+  
+  // always write last page so bootloader can patch it if necessary
+  if ( address >= deviceHandle->flash_size - deviceHandle->page_size )
+    unused = 0;
+
+  return !unused;
+}
+
+// what micronucleus_upload_step does next
+enum {
+  upload_erase,       // send next erase request
+  upload_crcs,        // ask for CRCs of next few pages
+  upload_crcs_read,   // store CRCs device replied with
+  upload_write,       // send next page that needs writing
+  upload_run,         // start program
+  upload_done,
+  upload_wait         // wait for device, then go to next_state
+};
+
+// Waits duration milliseconds for device. If request is given, device is
+// polled with it until it answers with length bytes, giving up after twice
+// the duration, otherwise the whole duration is waited out.
+static void micronucleus_uploadWait(micronucleus_upload* upload, unsigned int duration,
+                                    int request, int length, int next_state) {
+  upload->wait_start = micros();
+  upload->wait_duration = duration;
+  upload->poll_request = request;
+  upload->poll_length = length;
+  upload->next_state = next_state;
+  upload->state = upload_wait;
+  upload->deadline = request ? upload->wait_start : upload->wait_start + duration * 1000ULL;
+}
+
+// Status request is answered once device is done with flash
+static int micronucleus_uploadPollStatus(micronucleus_upload* upload) {
+  return (upload->device->features & MICRONUCLEUS_FEATURE_STATUS) ? 5 : 0;
+}
+
+static void micronucleus_uploadStartErase(micronucleus_upload* upload) {
+  micronucleus* deviceHandle = upload->device;
+  unsigned int program_size = upload->program_size;
+
+  upload->phase = MICRONUCLEUS_UPLOAD_ERASING;
+  upload->state = upload_erase;
+  upload->erase_sleep = deviceHandle->erase_sleep;
+  upload->erase_pages = deviceHandle->pages; // pages device will step through
+  upload->erase_done = 0;
+
+  if (!(deviceHandle->features & MICRONUCLEUS_FEATURE_ERASE_RANGE) || program_size >= deviceHandle->flash_size)
+    program_size = 0;
+
+  if (program_size) {
+    // program's pages and last page
+    upload->erase_pages = (program_size + deviceHandle->page_size - 1) / deviceHandle->page_size + 1;
+    if (upload->erase_pages > deviceHandle->pages) upload->erase_pages = deviceHandle->pages;
+
+    // then restoring reset vector to bootloader
+    unsigned int range_sleep = deviceHandle->write_sleep * (upload->erase_pages + 1);
+    if (range_sleep < upload->erase_sleep) upload->erase_sleep = range_sleep;
+  }
+  upload->erase_address = program_size;
+
+  deviceHandle->erased = 1;
+}
+
+static void micronucleus_uploadStartWrite(micronucleus_upload* upload) {
+  micronucleus* deviceHandle = upload->device;
+
+  upload->phase = MICRONUCLEUS_UPLOAD_WRITING;
+  upload->address = 0;
+  upload->confirmed = 0;
+  upload->prepared = 0;
+  upload->erased = deviceHandle->erased;
+  upload->write_sleep = deviceHandle->write_sleep;
+  upload->state = upload_write;
+
+  // erasing each page takes as long as writing it
+  if (micronucleus_eraseOnWrite(deviceHandle)) {
+    upload->write_sleep *= 2;
+
+    // pages aren't all erased, so we can leave alone ones that haven't changed
+    if (deviceHandle->features & MICRONUCLEUS_FEATURE_PAGE_CRC) {
+      upload->crcs = malloc(deviceHandle->pages * sizeof(unsigned int));
+      upload->crcs_read = 0;
+      if (upload->crcs) upload->state = upload_crcs;
+    }
+  }
+}
+
+// Goes on to whatever comes after erasing or writing
+static void micronucleus_uploadNext(micronucleus_upload* upload) {
+  // flash no longer erased for another upload
+  if (upload->phase == MICRONUCLEUS_UPLOAD_WRITING) upload->device->erased = 0;
+
+  if (upload->phase == MICRONUCLEUS_UPLOAD_ERASING && upload->write) {
+    micronucleus_uploadStartWrite(upload);
+  } else if (upload->run) {
+    upload->phase = MICRONUCLEUS_UPLOAD_RUNNING;
+    upload->state = upload_run;
+  } else {
+    upload->phase = MICRONUCLEUS_UPLOAD_DONE;
+    upload->state = upload_done;
+  }
+}
+
+// Points upload's page_data at page as it's sent to the device, straight from
+// the image unless it has to be changed. Returns 1 if page must be written, 0
+// if it can be skipped.
+static int micronucleus_uploadPreparePage(micronucleus_upload* upload, unsigned int address) {
+  micronucleus* deviceHandle = upload->device;
+  micronucleus_image* image = upload->image;
+  unsigned int page_length = deviceHandle->page_size;
+  int last = address >= deviceHandle->flash_size - deviceHandle->page_size;
+  const unsigned char* block = image->blocks[address / MICRONUCLEUS_IMAGE_BLOCK];
+
+  // work around a bug in older bootloader versions
+  if (deviceHandle->version.major == 1 && deviceHandle->version.minor <= 2
+      && address / deviceHandle->page_size == deviceHandle->pages - 1) {
+    page_length = deviceHandle->flash_size % deviceHandle->page_size;
+  }
+  upload->page_length = page_length;
+
+  // Pages file has no data for are already blank, unless device erases them
+  // as they're written and they're inside the program. Page 0 holds the reset
+  // vector and the last page always gets written so bootloader can patch it.
+  if (address != 0 && !last && !micronucleus_image_dirty(image, address, page_length) &&
+      (address >= image->end || !micronucleus_eraseOnWrite(deviceHandle)))
+    return 0;
+
+  if (block && address % MICRONUCLEUS_IMAGE_BLOCK + page_length <= MICRONUCLEUS_IMAGE_BLOCK) {
+    upload->page_data = block + address % MICRONUCLEUS_IMAGE_BLOCK;
+  } else {
+    micronucleus_image_read(image, address, upload->page, page_length);
+    upload->page_data = upload->page;
+  }
+
+  // later versions leave it to us to put rjmp to user code at end of flash
+  // (bootloader patches page 0 with its own vector)
+  if ( deviceHandle->version.major >= 2 && last )
+  {
+    unsigned user_reset_addr = deviceHandle->flash_size;
+    unsigned data;
+    unsigned char vector[2];
+
+    micronucleus_image_read(image, 0, vector, 2);
+    data = (vector[1] * 0x100 + vector[0] + 0x1000 - user_reset_addr/2) & ~0x1000;
+
+    // move user reset vector to end of last page
+    if (upload->page_data != upload->page) memcpy(upload->page, upload->page_data, page_length);
+    upload->page [user_reset_addr - address + 0] = data >> 0 & 0xff;
+    upload->page [user_reset_addr - address + 1] = data >> 8 & 0xff;
+    upload->page_data = upload->page;
+  }
+
+  return 1;
+}
+
+// Gets next page that needs writing ready to send, skipping ahead over ones
+// that don't, so this can be done while device is busy with the last page.
+// Returns 1 if there is one, 0 if address is past the end.
+static int micronucleus_uploadPrepare(micronucleus_upload* upload) {
+  micronucleus* deviceHandle = upload->device;
+  unsigned char* expected = upload->expected;
+  unsigned int  address;
+  unsigned char vector[2];
+
+  upload->prepared = 1;
+
+  for (; (address = upload->address) < deviceHandle->flash_size; upload->address += deviceHandle->page_size) {
+    unsigned char unused = !micronucleus_uploadPreparePage(upload, address);
+    upload->patch = 0;
+
+    // skip page if device already has it, as the bootloader would patch it.
+    // Older versions relocate the user reset vector from what they see in page
+    // 0, so it must always be written for them.
+    if ( !unused && upload->crcs && (address != 0 || deviceHandle->version.major >= 2) )
+    {
+      memcpy(expected, upload->page_data, upload->page_length);
+      
+      if ( address == 0 )
+      {
+        unsigned bootloader_addr = deviceHandle->flash_size + 2;
+        unsigned data = 0xC000 + bootloader_addr/2 - 1; // rjmp to bootloader
+        expected [0] = data >> 0 & 0xff;
+        expected [1] = data >> 8 & 0xff;
+      }
+      
+      if ( deviceHandle->version.major < 2 &&
+           address >= deviceHandle->flash_size - deviceHandle->page_size )
+      {
+        unsigned user_reset_addr = deviceHandle->flash_size;
+        unsigned data;
+        micronucleus_image_read(upload->image, 0, vector, 2);
+        data = (vector[1] * 0x100 + vector[0] + 0x1000 - user_reset_addr/2) & ~0x1000;
+        expected [user_reset_addr - address + 0] = data >> 0 & 0xff;
+        expected [user_reset_addr - address + 1] = data >> 8 & 0xff;
+      }
+      
+      if ( micronucleus_crc16(expected, upload->page_length) == upload->crcs [address / deviceHandle->page_size] )
+        unused = 1;
+      else
+        upload->patch = (deviceHandle->features & MICRONUCLEUS_FEATURE_PATCH_PAGE) &&
+                        (deviceHandle->features & MICRONUCLEUS_FEATURE_READ_FLASH);
+    }
+    
+    if ( !unused ) // skip unused pages
+      return 1;
+  }
+
+  return 0;
+}
+
+// Sends prepared page. Returns 1 if sent, negative for fail.
+static int micronucleus_uploadSend(micronucleus_upload* upload) {
+  micronucleus* deviceHandle = upload->device;
+  unsigned int  address = upload->address;
+  unsigned int  page_length = upload->page_length;
+  unsigned char patch[page_length];
+  int           patch_length = 0;
+  int           res;
+
+  // reading back what's there needs the device, so can't be done ahead
+  if ( upload->patch )
+    patch_length = micronucleus_diffPage(deviceHandle, address, upload->expected, page_length, patch);
+  
+  if ( patch_length )
+  {
+    // send only changed words; device copies the rest from flash
+    res = micronucleus_control(deviceHandle,
+           USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+           9,
+           0, address,
+           patch, patch_length,
+           MICRONUCLEUS_USB_TIMEOUT);
+    if (res == patch_length) res = page_length;
+  }
+  else
+  {
+    // ask microcontroller to write this page's data
+    res = micronucleus_writePage(deviceHandle, address, upload->page_data, page_length);
+  }
+  
+  return res == (int) page_length ? 1 : (res < 0 ? res : -1);
+}
+
+static micronucleus_upload* micronucleus_uploadStart(micronucleus* deviceHandle, unsigned int program_size,
+                                                     micronucleus_image* image, int erase, int write, int run) {
+  micronucleus_upload* upload = calloc(1, sizeof(micronucleus_upload));
+  if (!upload) return NULL;
+
+  upload->device = deviceHandle;
+  upload->program_size = image ? image->end : program_size;
+  upload->image = image;
+  upload->write = write;
+  upload->run = run;
+  upload->deadline = micros();
+
+  if (erase) {
+    micronucleus_uploadStartErase(upload);
+  } else if (write) {
+    micronucleus_uploadStartWrite(upload);
+  } else {
+    upload->phase = MICRONUCLEUS_UPLOAD_ERASING; // so it goes on to running
+    micronucleus_uploadNext(upload);
+  }
+
+  return upload;
+}
+
+// Image holding all of a flat program, so each of its pages gets written
+static micronucleus_image* micronucleus_flatImage(unsigned int program_size, const unsigned char* program) {
+  micronucleus_image* image = micronucleus_image_new();
+
+  if (image && micronucleus_image_store(image, 0, program, program_size) != 0) {
+    micronucleus_image_free(image);
+    image = NULL;
+  }
+
+  return image;
+}
+
+micronucleus_upload* micronucleus_upload_beginImage(micronucleus* deviceHandle, micronucleus_image* image, int run) {
+  int erase = !(deviceHandle->features & MICRONUCLEUS_FEATURE_ERASE_WRITE) && !deviceHandle->erased;
+
+  return micronucleus_uploadStart(deviceHandle, 0, image, erase, 1, run);
+}
+
+micronucleus_upload* micronucleus_upload_begin(micronucleus* deviceHandle, unsigned int program_size,
+                                               unsigned char* program, int run) {
+  micronucleus_image* image = micronucleus_flatImage(program_size, program);
+  micronucleus_upload* upload = image ? micronucleus_upload_beginImage(deviceHandle, image, run) : NULL;
+
+  if (upload) {
+    upload->own_image = 1;
+  } else {
+    micronucleus_image_free(image);
+  }
+
+  return upload;
+}
+
+int micronucleus_upload_step(micronucleus_upload* upload) {
+  micronucleus* deviceHandle = upload->device;
+  unsigned int n, i;
+  int res;
+
+  if ((long long) (upload->deadline - micros()) > 0) return 1;
+  upload->deadline = micros();
+
+  switch (upload->state) {
+  case upload_wait:
+    if (upload->poll_request) {
+      // only give up if time was already up when this poll was sent, so a
+      // poll that times out or a host that stalls still gets another try
+      unsigned long long polled = micros();
+
+      res = micronucleus_control(deviceHandle, 0xC0, upload->poll_request, 0, 0, upload->reply,
+                                 upload->poll_length, MICRONUCLEUS_STATUS_TIMEOUT);
+      if (res != upload->poll_length) {
+        if (polled - upload->wait_start < upload->wait_duration * 2000ULL) {
+          upload->deadline = micros() + 1000;
+          return 1;
         }
 
-        nucleus->device = usb_open(dev);
+        if (upload->next_state != upload_crcs_read) return res < 0 ? res : -1;
+
+        // just write every page
+        free(upload->crcs);
+        upload->crcs = NULL;
+        upload->state = upload_write;
+        return 1;
+      }
+    }
+    upload->state = upload->next_state;
+    return 1;
+
+  case upload_erase:
+    // device may finish early when carrying on an erase that was cut short
+    if (upload->erase_done >= upload->erase_pages ||
+        (upload->erase_done && upload->poll_request == 5 && upload->reply[0] == 0x81)) {
+      micronucleus_uploadNext(upload);
+      return 1;
+    }
+
+    // with chunked erase, a few pages per request, so device never stays
+    // silent on USB long enough to be dropped. Device continues each request
+    // where the last stopped.
+    n = (deviceHandle->features & MICRONUCLEUS_FEATURE_ERASE_CHUNK) ? MICRONUCLEUS_ERASE_CHUNK : 0;
+    res = micronucleus_control(deviceHandle, 0xC0, 2, n, upload->erase_address, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+    if (res < 0) return res;
+
+    upload->erase_chunk = n ? n : upload->erase_pages;
+    upload->erase_done += upload->erase_chunk;
+
+    // last chunk may also restore reset vector
+    micronucleus_uploadWait(upload, n ? deviceHandle->write_sleep * (n + 1) : upload->erase_sleep,
+                            micronucleus_uploadPollStatus(upload), 3, upload_erase);
+    return 1;
+
+  case upload_crcs:
+    // only pages holding the image and the last page can need writing
+    if (upload->crcs_read && upload->crcs_read * deviceHandle->page_size >= upload->program_size &&
+        upload->crcs_read < deviceHandle->pages - 1)
+      upload->crcs_read = deviceHandle->pages - 1;
+
+    if (upload->crcs_read >= deviceHandle->pages) {
+      upload->state = upload_write;
+      return 1;
+    }
+
+    // device does at most four per request
+    n = deviceHandle->pages - upload->crcs_read;
+    if (n > 4) n = 4;
+
+    res = micronucleus_control(deviceHandle, 0xC0, 6, n, upload->crcs_read * deviceHandle->page_size,
+                               NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+    if (res < 0) {
+      free(upload->crcs);
+      upload->crcs = NULL;
+      upload->state = upload_write;
+      return 1;
+    }
+
+    micronucleus_uploadWait(upload, deviceHandle->write_sleep, 6, n * 2, upload_crcs_read);
+    return 1;
+
+  case upload_crcs_read:
+    for (i = 0; i < (unsigned int) upload->poll_length / 2; i++)
+      upload->crcs[upload->crcs_read++] = upload->reply[i*2] + (upload->reply[i*2+1]<<8);
+    upload->state = upload_crcs;
+    return 1;
+
+  case upload_write:
+    // pages that needn't be written are skipped without waiting
+    if (!upload->prepared) micronucleus_uploadPrepare(upload);
+    upload->prepared = 0;
+
+    // device has finished with pages before this one
+    upload->confirmed = upload->address;
+
+    if (upload->address >= deviceHandle->flash_size) {
+      micronucleus_uploadNext(upload);
+      return 1;
+    }
+
+    res = micronucleus_uploadSend(upload);
+    upload->address += deviceHandle->page_size;
+    if (res < 0) return res;
+
+    // give microcontroller enough time to write this page and come back
+    // online, getting the next one ready meanwhile
+    micronucleus_uploadWait(upload, upload->write_sleep, micronucleus_uploadPollStatus(upload), 3, upload_write);
+    micronucleus_uploadPrepare(upload);
+    return 1;
+
+  case upload_run:
+    res = micronucleus_startApp(deviceHandle);
+    if (res < 0) return res;
+
+    upload->phase = MICRONUCLEUS_UPLOAD_DONE;
+    upload->state = upload_done;
+    return 1;
+  }
+
+  return 0;
+}
+
+long micronucleus_upload_wait(micronucleus_upload* upload) {
+  long long wait = (long long) (upload->deadline - micros());
+
+  return wait > 0 ? (long) ((wait + 999) / 1000) : 0;
+}
+
+float micronucleus_upload_progress(micronucleus_upload* upload) {
+  float waited = 1.0f; // of current erase request
+  float progress;
 
-        // get nucleus info
-        unsigned char buffer[4];
-        int res = usb_control_msg(nucleus->device, 0xC0, 0, 0, 0, buffer, 4, MICRONUCLEUS_USB_TIMEOUT);
-        assert(res >= 4);
+  if (upload->state == upload_wait && upload->wait_duration) {
+    float elapsed = (micros() - upload->wait_start) / 1000.0f;
+    if (elapsed < upload->wait_duration) waited = elapsed / upload->wait_duration;
+  }
+
+  switch (upload->phase) {
+  case MICRONUCLEUS_UPLOAD_ERASING:
+    if (!upload->erase_pages) return 0.0f;
+    progress = (upload->erase_done - upload->erase_chunk + waited * upload->erase_chunk) / upload->erase_pages;
+    return progress < 1.0f ? progress : 1.0f;
+
+  case MICRONUCLEUS_UPLOAD_WRITING:
+    return ((float) upload->address) / ((float) upload->device->flash_size);
+  }
+
+  return 1.0f;
+}
+
+int micronucleus_upload_resume(micronucleus_upload* upload, micronucleus* deviceHandle) {
+  unsigned char command;
+  unsigned int address;
+  unsigned int page = upload->confirmed;
+  int resumed;
+
+  upload->device = deviceHandle;
+  upload->deadline = micros();
 
-        nucleus->flash_size = (buffer[0]<<8) + buffer[1];
-        nucleus->page_size = buffer[2];
-        nucleus->pages = (nucleus->flash_size / nucleus->page_size);
-        if (nucleus->pages * nucleus->page_size < nucleus->flash_size) nucleus->pages += 1;
-        nucleus->write_sleep = buffer[3];
-        nucleus->erase_sleep = nucleus->write_sleep * nucleus->pages;
+  switch (upload->phase) {
+  case MICRONUCLEUS_UPLOAD_WRITING:
+    deviceHandle->erased = upload->erased;
+
+    if (!micronucleus_eraseOnWrite(deviceHandle)) {
+      // Pages can't be written twice without erasing, so device has to say
+      // where it got to. That's the page after the last one it confirmed, or
+      // the one after that if its reply to the last write was lost. Address
+      // 0 might mean it was reset, so it's no use.
+      if (!(deviceHandle->features & MICRONUCLEUS_FEATURE_RESUME) ||
+          micronucleus_getStatus(deviceHandle, &command, &address) != 0 ||
+          command == 0x82 || // partway through erasing
+          (address = address & ~(deviceHandle->page_size - 1)) == 0 ||
+          (address != page && address != page + deviceHandle->page_size)) {
+        micronucleus_uploadStartErase(upload);
+        return 0;
       }
+      page = address;
+    } else if (deviceHandle->version.major < 2 &&
+               (!(deviceHandle->features & MICRONUCLEUS_FEATURE_STATUS) ||
+                micronucleus_getStatus(deviceHandle, &command, &address) != 0 || address == 0)) {
+      // Version 1 device learns program's reset vector from page 0 and puts
+      // it in the last page, but forgets it if reset. Unless device shows
+      // it still has its place, page 0 has to be written again.
+      page = 0;
     }
+    resumed = page != 0 || upload->confirmed == 0;
+
+    // rewriting a page erases it first, so it's fine to repeat one
+    upload->address = page;
+    upload->confirmed = page;
+    upload->prepared = 0;
+    upload->state = upload_write;
+    if (upload->crcs && upload->crcs_read < deviceHandle->pages) upload->state = upload_crcs;
+    return resumed;
+
+  case MICRONUCLEUS_UPLOAD_RUNNING:
+    upload->state = upload_run;
+    return 1;
+
+  case MICRONUCLEUS_UPLOAD_DONE:
+    return 1;
   }
 
-  return nucleus;
+  // erasing again erases the same pages
+  micronucleus_uploadStartErase(upload);
+  return 0;
+}
+
+void micronucleus_upload_cancel(micronucleus_upload* upload) {
+  if (!upload) return;
+
+  free(upload->crcs);
+  if (upload->own_image) micronucleus_image_free(upload->image);
+  free(upload);
 }
 
-int micronucleus_eraseFlash(micronucleus* deviceHandle, micronucleus_callback progress) {
+int micronucleus_upload_finish(micronucleus_upload* upload, micronucleus_callback progress) {
+  unsigned long long wake;
   int res;
-  res = usb_control_msg(deviceHandle->device, 0xC0, 2, 0, 0, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
 
-  // give microcontroller enough time to erase all writable pages and come back online
-  float i = 0;
-  while (i < 1.0) {
-    // update progress callback if one was supplied
-    if (progress) progress(i);
+  if (!upload) return -1;
+
+  while ((res = micronucleus_upload_step(upload)) > 0) {
+    if (progress) progress(micronucleus_upload_progress(upload));
 
-    delay(((float) deviceHandle->erase_sleep) / 100.0f);
-    i += 0.01;
+    // sleep until the deadline itself, not for however long is left after
+    // the above, waking every so often to keep progress moving during long waits
+    wake = micros() + 10000;
+    delayUntil(upload->deadline < wake ? upload->deadline : wake);
   }
 
+  if (progress && res == 0) progress(1.0);
+
+  return res;
+}
+
+int micronucleus_eraseFlash(micronucleus* deviceHandle, unsigned int program_size, micronucleus_callback progress) {
+  micronucleus_upload* upload = micronucleus_uploadStart(deviceHandle, program_size, NULL, 1, 0, 0);
+  int res = micronucleus_upload_finish(upload, progress);
+
+  micronucleus_upload_cancel(upload);
+
   /* Under Linux, the erase process is often aborted with errors such as:
    usbfs: USBDEVFS_CONTROL failed cmd micronucleus rqt 192 rq 2 len 0 ret -84
    This seems to be because the erase is taking long enough that the device
@@ -104,8 +913,8 @@ int micronucleus_eraseFlash(micronucleus* deviceHandle, micronucleus_callback pr
    Assertion failed: (res >= 4), function micronucleus_connect, file library/micronucleus_lib.c, line 63.
   */
   if (res == -5 || res == -34 || res == -84) {
-    if (res = -34) {
-      usb_close(deviceHandle->device);
+    if (res == -34) {
+      deviceHandle->transport->close(deviceHandle->device);
       deviceHandle->device = NULL;
     }
 
@@ -115,89 +924,114 @@ int micronucleus_eraseFlash(micronucleus* deviceHandle, micronucleus_callback pr
   }
 }
 
+int micronucleus_writeImage(micronucleus* deviceHandle, micronucleus_image* image, micronucleus_callback prog) {
+  micronucleus_upload* upload = micronucleus_uploadStart(deviceHandle, 0, image, 0, 1, 0);
+  int res = micronucleus_upload_finish(upload, prog);
+
+  micronucleus_upload_cancel(upload);
+  return res == 0 ? 0 : -1;
+}
+
 int micronucleus_writeFlash(micronucleus* deviceHandle, unsigned int program_size, unsigned char* program, micronucleus_callback prog) {
-  unsigned char page_length = deviceHandle->page_size;
-  unsigned char page_buffer[page_length];
-  unsigned int  address; // overall flash memory address
-  unsigned int  page_address; // address within this page when copying buffer
-  unsigned int  res;
-  unsigned int  userReset;
-  
-  for (address = 0; address < deviceHandle->flash_size; address += deviceHandle->page_size) {
-  unsigned char unused = 1;
-  
-    // work around a bug in older bootloader versions
-    if (deviceHandle->version.major == 1 && deviceHandle->version.minor <= 2
-        && address / deviceHandle->page_size == deviceHandle->pages - 1) {
-      page_length = deviceHandle->flash_size % deviceHandle->page_size;
-    }
+  micronucleus_image* image = micronucleus_flatImage(program_size, program);
+  int res = image ? micronucleus_writeImage(deviceHandle, image, prog) : -1;
 
-    // copy in bytes from user program
-    for (page_address = 0; page_address < page_length; page_address += 1) {
-      if (address + page_address > program_size) {
-        page_buffer[page_address] = 0xFF; // pad out remainder with unprogrammed bytes
-      } else {
-          unused = 0;
-        page_buffer[page_address] = program[address + page_address]; // load from user program
-      }
-    }
+  micronucleus_image_free(image);
+  return res;
+}
 
-    // later versions leave it to us to put rjmp to user code at end of flash
-    if ( deviceHandle->version.major >= 2 )
-    {
-      if ( address == 0 ) 
-        // save user reset vector (bootloader will patch with its vector)
-        userReset = page_buffer [1] * 0x100 + page_buffer [0];
-      
-      if ( address >= deviceHandle->flash_size - deviceHandle->page_size )
-      {
-        // move user reset vector to end of last page
-        unsigned user_reset_addr = deviceHandle->flash_size;
-        unsigned data = (userReset + 0x1000 - user_reset_addr/2) & ~0x1000;
-        
-        page_buffer [user_reset_addr - address + 0] = data >> 0 & 0xff;
-        page_buffer [user_reset_addr - address + 1] = data >> 8 & 0xff;
-        unused = 0;
-      }
-    }
-    
-    // always write last page so bootloader can patch it if necessary
-    if ( address >= deviceHandle->flash_size - deviceHandle->page_size )
-      unused = 0;
-    
-    res = page_length;
-    if ( !unused ) // skip unused pages
-    {
-      // ask microcontroller to write this page's data
-      res = usb_control_msg(deviceHandle->device,
-             USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-             1,
-             page_length, address,
-             page_buffer, page_length,
-             MICRONUCLEUS_USB_TIMEOUT);
-    }
-    
-    // call progress update callback if that's a thing
-    if (prog) prog(((float) address) / ((float) deviceHandle->flash_size));
+// Checks CRC of flash below program_size against expected, which holds the
+// program and is freed
+static int micronucleus_verifyExpected(micronucleus* deviceHandle, unsigned int program_size,
+                                       unsigned char* expected) {
+  unsigned char buffer[2];
+  unsigned int user_reset_addr = deviceHandle->flash_size;
+  unsigned int userReset = expected[1] * 0x100 + expected[0];
+  unsigned int data;
+  int res;
 
-    if ( !unused )
-    {
-      // give microcontroller enough time to write this page and come back online
-      delay(deviceHandle->write_sleep);
-    }
-    
-    if (res != page_length) return -1;
+  // bootloader puts its own vector at reset...
+  data = 0xC000 + (user_reset_addr + 2)/2 - 1;
+  expected[0] = data >> 0 & 0xff;
+  expected[1] = data >> 8 & 0xff;
+
+  // ...and program's at end of flash
+  if (program_size >= user_reset_addr + 2) {
+    data = (userReset + 0x1000 - user_reset_addr/2) & ~0x1000;
+    expected[user_reset_addr + 0] = data >> 0 & 0xff;
+    expected[user_reset_addr + 1] = data >> 8 & 0xff;
   }
 
-  // call progress update callback with completion status
-  if (prog) prog(1.0);
+  data = micronucleus_crc16(expected, program_size);
+  free(expected);
+
+  // device takes roughly 1ms per kilobyte
+  res = micronucleus_control(deviceHandle, 0xC0, 7, 0, program_size, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+  if (res < 0) return res;
+
+  res = micronucleus_readResult(deviceHandle, 7, buffer, 2, program_size / 512 + deviceHandle->write_sleep);
+  if (res < 0) return res;
+
+  return (unsigned int) (buffer[0] + (buffer[1]<<8)) == data ? 0 : 1;
+}
+
+int micronucleus_verify(micronucleus* deviceHandle, unsigned int program_size, unsigned char* program) {
+  unsigned char* expected;
+
+  if (!(deviceHandle->features & MICRONUCLEUS_FEATURE_IMAGE_CRC)) return -1;
+
+  if (program_size > deviceHandle->flash_size + 2) program_size = deviceHandle->flash_size + 2;
+  if (program_size < 2) return -1;
+
+  // program as it ends up in flash
+  expected = malloc(program_size);
+  if (!expected) return -1;
+  memcpy(expected, program, program_size);
+
+  return micronucleus_verifyExpected(deviceHandle, program_size, expected);
+}
+
+int micronucleus_verifyImage(micronucleus* deviceHandle, micronucleus_image* image) {
+  unsigned int program_size = image->end;
+  unsigned char* expected;
+
+  if (!(deviceHandle->features & MICRONUCLEUS_FEATURE_IMAGE_CRC)) return -1;
+
+  if (program_size > deviceHandle->flash_size + 2) program_size = deviceHandle->flash_size + 2;
+  if (program_size < 2) return -1;
+
+  // program as it ends up in flash
+  expected = malloc(program_size);
+  if (!expected) return -1;
+  micronucleus_image_read(image, 0, expected, program_size);
+
+  return micronucleus_verifyExpected(deviceHandle, program_size, expected);
+}
+
+int micronucleus_readFlash(micronucleus* deviceHandle, unsigned int address, unsigned int length,
+                           unsigned char* buffer, micronucleus_callback prog) {
+  unsigned int done = 0;
+  int res;
+
+  if (!(deviceHandle->features & MICRONUCLEUS_FEATURE_READ_FLASH)) return -1;
+
+  while (done < length) {
+    unsigned int n = length - done;
+    if (n > MICRONUCLEUS_READ_CHUNK) n = MICRONUCLEUS_READ_CHUNK;
+
+    res = micronucleus_control(deviceHandle, 0xC0, 8, 0, address + done, buffer + done, n, MICRONUCLEUS_USB_TIMEOUT);
+    if (res != (int) n) return res < 0 ? res : -1;
+
+    done += n;
+    if (prog) prog((float) done / length);
+  }
 
   return 0;
 }
 
 int micronucleus_startApp(micronucleus* deviceHandle) {
   int res;
-  res = usb_control_msg(deviceHandle->device, 0xC0, 4, 0, 0, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+  res = micronucleus_control(deviceHandle, 0xC0, 4, 0, 0, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
 
   if(res!=0)
     return -1;
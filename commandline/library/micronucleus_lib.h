@@ -36,6 +36,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "micronucleus_image.h"
 /*******************************************************************************/
 
 /********************************************************************************
@@ -45,6 +46,35 @@
 #define MICRONUCLEUS_PRODUCT_ID  0x0753
 #define MICRONUCLEUS_USB_TIMEOUT 0xFFFF
 #define MICRONUCLEUS_MAX_MAJOR_VERSION 2
+
+// optional firmware features, reported after the basic info reply
+#define MICRONUCLEUS_FEATURE_SETUP_WRITE 0x0001 // page data sent in SETUP packets
+#define MICRONUCLEUS_FEATURE_STATUS      0x0002 // status request for polling readiness
+#define MICRONUCLEUS_FEATURE_SKIP_BLANK  0x0004 // erase skips blank pages, info reports used pages
+#define MICRONUCLEUS_FEATURE_ERASE_RANGE 0x0008 // erase can be limited to end of program
+#define MICRONUCLEUS_FEATURE_ERASE_WRITE 0x0010 // pages can be erased as they're written
+#define MICRONUCLEUS_FEATURE_ERASE_CHUNK 0x0020 // erase can be split over several requests
+#define MICRONUCLEUS_FEATURE_PAGE_CRC    0x0040 // device can report CRC of each flash page
+#define MICRONUCLEUS_FEATURE_IMAGE_CRC   0x0080 // device can report CRC of all flash below an address
+#define MICRONUCLEUS_FEATURE_READ_FLASH  0x0100 // flash can be read back
+#define MICRONUCLEUS_FEATURE_PATCH_PAGE  0x0200 // only changed words of a page need be sent
+#define MICRONUCLEUS_FEATURE_COMPRESS    0x0400 // page data can be run-length encoded
+#define MICRONUCLEUS_FEATURE_RESUME      0x0800 // writing can carry on at page device was on
+
+// most bytes device sends in reply to info request
+#define MICRONUCLEUS_INFO_SIZE 7
+
+// bytes of flash device sends per read request
+#define MICRONUCLEUS_READ_CHUNK 128
+
+// largest page size a device can report
+#define MICRONUCLEUS_MAX_PAGE 256
+
+// pages erased per request when device supports chunked erase
+#define MICRONUCLEUS_ERASE_CHUNK 8
+
+// timeout of each status request while waiting for device to finish flash operation
+#define MICRONUCLEUS_STATUS_TIMEOUT 20
 /*******************************************************************************/
 
 /********************************************************************************
@@ -57,9 +87,22 @@ typedef struct _micronucleus_version {
   unsigned char minor;
 } micronucleus_version;
 
+// moves requests to and from a device, so the library can drive one on libusb
+// or a simulated one
+typedef struct _micronucleus_transport {
+  // same arguments and result as usb_control_msg()
+  int (*control)(void *device, int requesttype, int request, int value, int index,
+                 char *bytes, int size, int timeout);
+  void (*close)(void *device);
+} micronucleus_transport;
+
 // handle representing one micronucleus device
 typedef struct _micronucleus {
-  usb_dev_handle *device;
+  const micronucleus_transport *transport;
+  void *device;             // transport's handle for device
+  char location[32];        // where device is attached, such as "001/004" for bus and
+                            // device number, to tell several apart
+  char serial[32];          // USB serial number, or empty if device has none
   // general information about device
   micronucleus_version version;
   unsigned int flash_size;  // programmable size (in bytes) of progmem
@@ -67,32 +110,328 @@ typedef struct _micronucleus {
   unsigned int pages;       // total number of pages to program
   unsigned int write_sleep; // milliseconds
   unsigned int erase_sleep; // milliseconds
+  unsigned int features;    // MICRONUCLEUS_FEATURE_* supported by device
+  unsigned char erased;     // set by micronucleus_eraseFlash until flash is written; otherwise pages are erased
+                            // as they're written, if device supports it
+  unsigned char setup_write; // set to send page data in SETUP packets, if device supports it. Off
+                            // by default, since libusb-0.1 waits a frame for each of those requests.
 } micronucleus;
 
+// attached device found by micronucleus_list, not opened yet
+typedef struct _micronucleus_entry {
+  char location[32];        // as in handle
+  micronucleus_version version;
+  int has_serial;           // device has a serial number, even if not known yet
+  char serial[32];          // serial number, if known from opening device before
+  unsigned char info[MICRONUCLEUS_INFO_SIZE]; // reply to info request, if known from
+  int info_length;          // opening device before; 0 if not, or if it may change
+  void *device;             // transport's device, until micronucleus_list is called again
+} micronucleus_entry;
+
 typedef void (*micronucleus_callback)(float progress);
 
+// what an upload is doing, as reported in micronucleus_upload.phase
+#define MICRONUCLEUS_UPLOAD_ERASING 0
+#define MICRONUCLEUS_UPLOAD_WRITING 1
+#define MICRONUCLEUS_UPLOAD_RUNNING 2
+#define MICRONUCLEUS_UPLOAD_DONE    3
+
+// upload driven a step at a time by micronucleus_upload_step
+typedef struct _micronucleus_upload {
+  micronucleus *device;
+  unsigned int program_size;
+  micronucleus_image *image;
+  int own_image;              // image was made for upload and is freed with it
+  int write;                  // write program after erasing
+  int run;                    // start program when written
+  int phase;                  // MICRONUCLEUS_UPLOAD_*
+  int state;                  // what next step does
+  unsigned long long deadline; // micros() when next step is due
+  // erasing
+  unsigned int erase_address; // end of program sent with erase requests, 0 for everything
+  unsigned int erase_pages;   // pages device steps through
+  unsigned int erase_done;    // pages erase requests so far cover
+  unsigned int erase_chunk;   // pages last erase request covers
+  unsigned int erase_sleep;   // milliseconds
+  // writing
+  unsigned int address;       // of next page
+  unsigned int confirmed;     // device has finished with pages below this
+  unsigned char erased;       // device's erased flag when writing started
+  unsigned int write_sleep;   // milliseconds
+  unsigned int *crcs;         // of pages already on device, or NULL if not known
+  unsigned int crcs_read;
+  int prepared;               // page at address is ready to send, or address is past the end
+  int patch;                  // page could be sent as a patch to what device has
+  unsigned int page_length;
+  const unsigned char *page_data;                // as sent to device, in image or page
+  unsigned char page[MICRONUCLEUS_MAX_PAGE];     // page_data when image's had to be changed
+  unsigned char expected[MICRONUCLEUS_MAX_PAGE]; // as it will end up in flash, for patching
+  // waiting for device
+  int next_state;
+  unsigned long long wait_start;
+  unsigned int wait_duration; // milliseconds
+  int poll_request;           // request device answers once ready, or 0 to wait whole time
+  int poll_length;            // bytes in answer
+  unsigned char reply[8];
+} micronucleus_upload;
+
+/*******************************************************************************/
+
+/********************************************************************************
+* List attached devices without opening them. What's known about a device from
+* opening it before at the same location is filled in, so opening it again
+* needn't ask. Call from one thread at a time.
+*     entries: filled with one entry for each device
+*     Returns: number of devices listed
+********************************************************************************/
+int micronucleus_list(micronucleus_entry* entries, int max);
 /*******************************************************************************/
 
 /********************************************************************************
-* Try to connect to the device
+* Open device from micronucleus_list, asking for its info only if not known
+*     Returns: device handle for success, NULL for fail
+********************************************************************************/
+micronucleus* micronucleus_open(micronucleus_entry* entry);
+/*******************************************************************************/
+
+/********************************************************************************
+* Try to connect to the device over libusb
 *     Returns: device handle for success, NULL for fail
 ********************************************************************************/
 micronucleus* micronucleus_connect();
 /*******************************************************************************/
 
+/********************************************************************************
+* Connect to attached devices that selector matches, up to max of them. Devices
+* that can't match aren't asked for their info, and only ones with a serial
+* number are opened to compare it.
+*     selector: location as "bus/device", or serial number (NULL or "*" for any)
+*     devices: filled with a handle for each device
+*     Returns: number of devices connected to
+********************************************************************************/
+int micronucleus_connectMatching(micronucleus** devices, int max, const char* selector);
+/*******************************************************************************/
+
+/********************************************************************************
+* Check whether selector, as for micronucleus_connectMatching, matches device
+*     Returns: 1 if it matches, 0 if not
+********************************************************************************/
+int micronucleus_matches(micronucleus* deviceHandle, const char* selector);
+/*******************************************************************************/
+
+/********************************************************************************
+* Wait until a USB device might have been plugged in, so connecting is worth
+* trying again. Uses notifications from the OS where available (inotify on
+* Linux), otherwise just waits a little.
+*     timeout: longest to wait, in milliseconds
+*     Returns: 1 if something may have changed, 0 if timed out
+********************************************************************************/
+int micronucleus_waitChange(unsigned int timeout);
+/*******************************************************************************/
+
+/********************************************************************************
+* Connect to every attached device, up to max of them
+*     devices: filled with a handle for each device
+*     Returns: number of devices connected to
+********************************************************************************/
+int micronucleus_connectAll(micronucleus** devices, int max);
+/*******************************************************************************/
+
+/********************************************************************************
+* Make handle for device reached through transport, reading its info. Closes
+* device if that fails.
+*     Returns: device handle for success, NULL for fail
+********************************************************************************/
+micronucleus* micronucleus_attach(const micronucleus_transport* transport, void* device,
+                                  micronucleus_version version);
+/*******************************************************************************/
+
+/********************************************************************************
+* As micronucleus_attach, but with info request already answered, such as from
+* opening device before.
+*     info: MICRONUCLEUS_INFO_SIZE bytes, filled with reply if length is 0
+*     length: bytes in info, or 0 to ask device and set it to bytes in reply
+********************************************************************************/
+micronucleus* micronucleus_attachInfo(const micronucleus_transport* transport, void* device,
+                                      micronucleus_version version, unsigned char* info,
+                                      int* length);
+/*******************************************************************************/
+
+/********************************************************************************
+* Fill in handle's device information from reply to info request, for
+* transports that make the request themselves
+*     length: bytes in reply, at least 4
+********************************************************************************/
+void micronucleus_setInfo(micronucleus* deviceHandle, const unsigned char* info, int length);
+/*******************************************************************************/
+
+/********************************************************************************
+* Close device handle and free it. Does nothing if NULL.
+********************************************************************************/
+void micronucleus_close(micronucleus* deviceHandle);
+/*******************************************************************************/
+
+/********************************************************************************
+* Read device status. Fails while the device is busy erasing or writing flash.
+*     command: last action device performed (may be NULL)
+*     address: next flash address device expects to be written (may be NULL)
+*     Returns: 0 for success, negative for fail
+********************************************************************************/
+int micronucleus_getStatus(micronucleus* deviceHandle, unsigned char* command,
+                           unsigned int* address);
+/*******************************************************************************/
+
+/********************************************************************************
+* Read CRC16 (as used by USB) of each of count pages starting at address
+*     Returns: 0 for success, negative for fail
+********************************************************************************/
+int micronucleus_getPageCrcs(micronucleus* deviceHandle, unsigned int address,
+                             unsigned int count, unsigned int* crcs);
+/*******************************************************************************/
+
 /********************************************************************************
 * Erase the flash memory
+*     program_size: end of program to be written, so device can erase only
+*                   that much if it supports it (0 to erase everything)
 ********************************************************************************/
-int micronucleus_eraseFlash(micronucleus* deviceHandle, micronucleus_callback progress);
+int micronucleus_eraseFlash(micronucleus* deviceHandle, unsigned int program_size,
+                            micronucleus_callback progress);
 /*******************************************************************************/
 
 /********************************************************************************
-* Write the flash memory
+* Write the flash memory. If flash wasn't erased with micronucleus_eraseFlash
+* and the device supports MICRONUCLEUS_FEATURE_ERASE_WRITE, each page is erased
+* just before it's written and pages not in the program are left alone. If the
+* device also supports MICRONUCLEUS_FEATURE_PAGE_CRC, pages already holding
+* the right data aren't written at all, and with MICRONUCLEUS_FEATURE_PATCH_PAGE
+* and MICRONUCLEUS_FEATURE_READ_FLASH, pages with only a few changed words have
+* just those sent. Pages are run-length encoded when the device supports
+* MICRONUCLEUS_FEATURE_COMPRESS and that makes them smaller.
 ********************************************************************************/
 int micronucleus_writeFlash(micronucleus* deviceHandle, unsigned int program_length,
                             unsigned char* program, micronucleus_callback progress);
 /*******************************************************************************/
 
+/********************************************************************************
+* Write image to flash memory, as micronucleus_writeFlash. Only pages the image
+* has data in are sent, straight from the image, along with page 0 and the
+* last page. Pages without data are written blank only if device erases pages
+* as they're written and they lie inside the image.
+********************************************************************************/
+int micronucleus_writeImage(micronucleus* deviceHandle, micronucleus_image* image,
+                            micronucleus_callback progress);
+/*******************************************************************************/
+
+/********************************************************************************
+* Start uploading program, as micronucleus_eraseFlash (unless that was already
+* done or device erases pages as they're written), micronucleus_writeFlash
+* and, if run is set, micronucleus_startApp would. Nothing is sent until the first step.
+*     Returns: upload for success, NULL for fail
+********************************************************************************/
+micronucleus_upload* micronucleus_upload_begin(micronucleus* deviceHandle, unsigned int program_length,
+                                               unsigned char* program, int run);
+/*******************************************************************************/
+
+/********************************************************************************
+* Start uploading image, as micronucleus_upload_begin and micronucleus_writeImage.
+* Image must be kept until upload is cancelled.
+*     Returns: upload for success, NULL for fail
+********************************************************************************/
+micronucleus_upload* micronucleus_upload_beginImage(micronucleus* deviceHandle, micronucleus_image* image, int run);
+/*******************************************************************************/
+
+/********************************************************************************
+* Do the next part of upload, if it's due: one request, or polling the device
+* while it's busy. Never waits, so it can be called from an event loop, each
+* time micronucleus_upload_wait says it's due.
+*     Returns: 1 if there's more to do, 0 when done, negative for fail
+********************************************************************************/
+int micronucleus_upload_step(micronucleus_upload* upload);
+/*******************************************************************************/
+
+/********************************************************************************
+* Milliseconds until the next step of upload is due, rounded up, 0 if it is
+* now. The exact deadline is in upload->deadline, as a micros() time.
+********************************************************************************/
+long micronucleus_upload_wait(micronucleus_upload* upload);
+/*******************************************************************************/
+
+/********************************************************************************
+* How far through its current phase upload is, from 0 to 1
+********************************************************************************/
+float micronucleus_upload_progress(micronucleus_upload* upload);
+/*******************************************************************************/
+
+/********************************************************************************
+* Do the rest of upload, sleeping until each step is due and calling progress
+* along the way. Sleeps are to absolute deadlines, so time spent preparing the
+* next page and reporting progress overlaps the device's busy time. Upload isn't freed, so it can be resumed if this fails.
+*     Returns: 0 for success, negative for fail
+********************************************************************************/
+int micronucleus_upload_finish(micronucleus_upload* upload, micronucleus_callback progress);
+/*******************************************************************************/
+
+/********************************************************************************
+* Carry on with a failed upload using deviceHandle, which can be the same
+* handle or one reconnected to the same device. Writing continues from the
+* last page the device confirmed when it erases pages as they're written, or
+* when it supports MICRONUCLEUS_FEATURE_RESUME and reports having got that far.
+* Otherwise flash has to be erased and the upload starts over. Version 1
+* devices that erase as they write start over at page 0 without erasing,
+* unless their status shows they weren't reset.
+*     Returns: 1 if upload carries on where it was, 0 if it starts over
+********************************************************************************/
+int micronucleus_upload_resume(micronucleus_upload* upload, micronucleus* deviceHandle);
+/*******************************************************************************/
+
+/********************************************************************************
+* Stop upload if it isn't done, and free it. Must be called for every upload,
+* including finished and failed ones. Stopping partway leaves flash partly
+* written, with the device still in the bootloader ready for another upload.
+* Does nothing if NULL.
+********************************************************************************/
+void micronucleus_upload_cancel(micronucleus_upload* upload);
+/*******************************************************************************/
+
+/********************************************************************************
+* Fill page_buffer with the page at address as it's sent to the device, for
+* transports that write pages themselves. Only needs device information in
+* handle.
+*     page_length: set to number of bytes to send
+*     Returns: 1 if page must be written, 0 if it can be skipped
+********************************************************************************/
+int micronucleus_preparePage(micronucleus* deviceHandle, unsigned int address,
+                             unsigned int program_length, const unsigned char* program,
+                             unsigned char* page_buffer, unsigned int* page_length);
+/*******************************************************************************/
+
+/********************************************************************************
+* Verify the flash memory holds the program, by comparing its CRC with one the
+* device calculates. Accounts for reset vector patching.
+*     Returns: 0 if it matches, 1 if it doesn't, negative for fail
+********************************************************************************/
+int micronucleus_verify(micronucleus* deviceHandle, unsigned int program_length,
+                        unsigned char* program);
+/*******************************************************************************/
+
+/********************************************************************************
+* Verify the flash memory holds image, as micronucleus_verify
+*     Returns: 0 if it matches, 1 if it doesn't, negative for fail
+********************************************************************************/
+int micronucleus_verifyImage(micronucleus* deviceHandle, micronucleus_image* image);
+/*******************************************************************************/
+
+/********************************************************************************
+* Read flash memory as it is on the device, including the bootloader's reset
+* vector at 0 and the relocated user one at flash_size. Requires
+* MICRONUCLEUS_FEATURE_READ_FLASH.
+*     Returns: 0 for success, negative for fail
+********************************************************************************/
+int micronucleus_readFlash(micronucleus* deviceHandle, unsigned int address,
+                           unsigned int length, unsigned char* buffer,
+                           micronucleus_callback progress);
+/*******************************************************************************/
+
 /********************************************************************************
 * Starts the user application
 ********************************************************************************/
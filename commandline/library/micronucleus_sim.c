@@ -0,0 +1,397 @@
+/*
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/***************************************************************/
+/* Transport to a simulated device, behaving like firmware/main.c */
+/* built with the optional features it's given                 */
+/***************************************************************/
+#include <errno.h>
+#include <string.h>
+#include "micronucleus_sim.h"
+#include "littleWire_util.h"
+
+#ifndef EPROTO
+  #define EPROTO 71
+#endif
+
+#ifndef ENODEV
+  #define ENODEV 19
+#endif
+
+// same as in firmware
+#define SIM_USER_RESET_ADDR (MICRONUCLEUS_SIM_BOOTLOADER - 2)
+#define SIM_RJMP_BOOTLOADER (MICRONUCLEUS_SIM_BOOTLOADER/2 - 1 + 0xC000)
+
+enum { cmd_info = 0, cmd_write = 1, cmd_erase = 2, cmd_fill = 3, cmd_run = 4 };
+enum { cmd_status = 5, cmd_crc = 6, cmd_verify = 7, cmd_read = 8, cmd_patch = 9 };
+enum { cmd_written = 0x80, cmd_erased = 0x81, cmd_erasing = 0x82 };
+
+// CRC16 as used by USB, like usbCrc16() in firmware
+static unsigned int micronucleus_sim_crc16(const unsigned char* data, unsigned int length) {
+  unsigned int crc = 0xFFFF;
+  int bit;
+
+  while (length--) {
+    crc ^= *data++;
+    for (bit = 0; bit < 8; bit++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+  }
+
+  return ~crc & 0xFFFF;
+}
+
+// Adds word to page buffer, patching reset vectors like version 1 firmware
+static void micronucleus_sim_fill(micronucleus_sim* sim, unsigned int data) {
+  if (sim->address == 0) {
+    sim->user_reset = data;
+    data = SIM_RJMP_BOOTLOADER;
+  }
+
+  if (sim->address == SIM_USER_RESET_ADDR)
+    data = (sim->user_reset + 0x1000 - SIM_USER_RESET_ADDR/2) & ~0x1000;
+
+  sim->page[sim->address % MICRONUCLEUS_SIM_PAGE_SIZE + 0] = data >> 0 & 0xff;
+  sim->page[sim->address % MICRONUCLEUS_SIM_PAGE_SIZE + 1] = data >> 8 & 0xff;
+  sim->address += 2;
+}
+
+// True if page at address is already erased
+static int micronucleus_sim_blank(micronucleus_sim* sim, unsigned int address) {
+  int i;
+
+  for (i = 0; i < MICRONUCLEUS_SIM_PAGE_SIZE; i++)
+    if (sim->flash[address + i] != 0xFF) return 0;
+
+  return 1;
+}
+
+// Erases page at address, unless device skips blank pages and it is. Returns
+// number of SPM operations this took.
+static unsigned long micronucleus_sim_erasePage(micronucleus_sim* sim, unsigned int address) {
+  if ((sim->features & MICRONUCLEUS_FEATURE_SKIP_BLANK) && micronucleus_sim_blank(sim, address))
+    return 0;
+
+  memset(sim->flash + address, 0xFF, MICRONUCLEUS_SIM_PAGE_SIZE);
+  sim->pages_erased++;
+  return 1;
+}
+
+// Erases from address down to beginning of flash, erase_count pages at most
+// (0 for no limit), like erase_flash() in firmware. Returns state device is
+// left in.
+static unsigned char micronucleus_sim_erase(micronucleus_sim* sim, unsigned long* spm_pages,
+                                            unsigned long* checked_pages) {
+  unsigned int address = sim->address;
+
+  do {
+    address -= MICRONUCLEUS_SIM_PAGE_SIZE;
+    *spm_pages += micronucleus_sim_erasePage(sim, address);
+    if (sim->features & MICRONUCLEUS_FEATURE_SKIP_BLANK) (*checked_pages)++;
+
+    // last page is erased first, then we skip down to end of image
+    if (address > sim->erase_end) address = sim->erase_end;
+  } while (address && (!sim->erase_count || --sim->erase_count));
+
+  sim->address = address;
+  if (address) return cmd_erasing;
+
+  // pages above image may still hold old code, so reset vector jumps to us
+  if (sim->erase_end < MICRONUCLEUS_SIM_BOOTLOADER - MICRONUCLEUS_SIM_PAGE_SIZE) {
+    sim->flash[0] &= SIM_RJMP_BOOTLOADER >> 0 & 0xff;
+    sim->flash[1] &= SIM_RJMP_BOOTLOADER >> 8 & 0xff;
+    (*spm_pages)++;
+  }
+
+  return cmd_erased;
+}
+
+// Adds run-length encoded page data to page buffer, like expand_words() in
+// firmware
+static void micronucleus_sim_expand(micronucleus_sim* sim, const unsigned char* bytes, int size) {
+  unsigned int count = 0;  // words left in current record
+  unsigned int repeat = 0; // current record repeats one word
+  int i;
+
+  for (i = 0; i + 1 < size; i += 2) {
+    unsigned int data = bytes[i] + (bytes[i+1] << 8);
+
+    if (!count) {
+      count = data & 0xff;
+      repeat = data >> 8;
+      continue;
+    }
+
+    // run stops at end of page
+    do
+      micronucleus_sim_fill(sim, data);
+    while (--count && repeat && sim->address % MICRONUCLEUS_SIM_PAGE_SIZE);
+  }
+}
+
+// Fills page buffer from patch of address and value of each changed word, and
+// what's already in flash for the rest, like patch_words() in firmware
+static void micronucleus_sim_patch(micronucleus_sim* sim, const unsigned char* bytes, int size) {
+  unsigned int end = sim->address + MICRONUCLEUS_SIM_PAGE_SIZE;
+  unsigned int address, data;
+  int i;
+
+  for (i = 0; i + 3 < size; i += 4) {
+    address = (bytes[i] + (bytes[i+1] << 8)) & ~1;
+    data = bytes[i+2] + (bytes[i+3] << 8);
+
+    // ignore any out of order or outside page
+    if (address < sim->address || address >= end) continue;
+
+    while (sim->address < address) {
+      sim->page[sim->address % MICRONUCLEUS_SIM_PAGE_SIZE + 0] = sim->flash[sim->address + 0];
+      sim->page[sim->address % MICRONUCLEUS_SIM_PAGE_SIZE + 1] = sim->flash[sim->address + 1];
+      sim->address += 2;
+    }
+
+    // reset vector must still jump to us
+    if (address == 0) data = SIM_RJMP_BOOTLOADER;
+    sim->page[address % MICRONUCLEUS_SIM_PAGE_SIZE + 0] = data >> 0 & 0xff;
+    sim->page[address % MICRONUCLEUS_SIM_PAGE_SIZE + 1] = data >> 8 & 0xff;
+    sim->address += 2;
+  }
+
+  for (; sim->address < end; sim->address += 2) {
+    sim->page[sim->address % MICRONUCLEUS_SIM_PAGE_SIZE + 0] = sim->flash[sim->address + 0];
+    sim->page[sim->address % MICRONUCLEUS_SIM_PAGE_SIZE + 1] = sim->flash[sim->address + 1];
+  }
+}
+
+// Writes page buffer to flash once it's full, as long as it's not the
+// bootloader. Returns number of SPM operations this took.
+static unsigned long micronucleus_sim_write(micronucleus_sim* sim) {
+  unsigned int page = sim->address - MICRONUCLEUS_SIM_PAGE_SIZE;
+  unsigned long spm_pages = 1;
+  int i;
+
+  if (sim->address % MICRONUCLEUS_SIM_PAGE_SIZE != 0 || sim->address - 2 >= MICRONUCLEUS_SIM_BOOTLOADER)
+    return 0;
+
+  if (sim->erase_on_write)
+    spm_pages += micronucleus_sim_erasePage(sim, page);
+
+  for (i = 0; i < MICRONUCLEUS_SIM_PAGE_SIZE; i++)
+    sim->flash[page + i] &= sim->page[i]; // writing can only clear bits
+  sim->pages_written++;
+
+  return spm_pages;
+}
+
+static int micronucleus_sim_control(void* device, int requesttype, int request, int value,
+                                    int index, char* bytes, int size, int timeout) {
+  micronucleus_sim* sim = device;
+  unsigned long spm_pages = 0; // flash work to do once request is answered
+  unsigned long crc_bytes = 0; // flash to CRC once request is answered
+  unsigned long checked_pages = 0; // pages checked for being blank
+  unsigned int command = request & 0xff;
+  unsigned int start;
+  int result = 0;
+  int i;
+
+  (void) requesttype; // direction follows from request
+  (void) timeout;     // device answers or not, host gives up on its own
+
+  if (sim->running) return -ENODEV;
+
+  // device doesn't answer while CPU is halted by SPM, so host gives up
+  if (micros() < sim->busy_until) {
+    delayMicroseconds(MICRONUCLEUS_SIM_FRAME_US);
+    return -EPROTO;
+  }
+
+  if (command == cmd_info) {
+    unsigned char reply[7] = {
+      SIM_USER_RESET_ADDR >> 8 & 0xff,
+      SIM_USER_RESET_ADDR      & 0xff,
+      MICRONUCLEUS_SIM_PAGE_SIZE,
+      MICRONUCLEUS_SIM_WRITE_SLEEP,
+      (sim->features & MICRONUCLEUS_SIM_FEATURES)      & 0xff,
+      (sim->features & MICRONUCLEUS_SIM_FEATURES) >> 8 & 0xff,
+      0
+    };
+    int length = 6;
+
+    // number of pages erase will actually have to erase
+    if (sim->features & MICRONUCLEUS_FEATURE_SKIP_BLANK) {
+      for (i = 0; i < MICRONUCLEUS_SIM_BOOTLOADER; i += MICRONUCLEUS_SIM_PAGE_SIZE)
+        if (!micronucleus_sim_blank(sim, i)) reply[6]++;
+      length = 7;
+    }
+
+    result = size < length ? size : length;
+    memcpy(bytes, reply, result);
+    command = sim->prev_command; // doesn't affect state
+  } else if (command == cmd_write) {
+    sim->erase_on_write = (sim->features & MICRONUCLEUS_FEATURE_ERASE_WRITE) && (value >> 8 & 1);
+
+    // carry on with page device was on, whatever host sent since
+    if ((sim->features & MICRONUCLEUS_FEATURE_RESUME) && sim->prev_command != cmd_erasing &&
+        !((index ^ sim->address) & ~(MICRONUCLEUS_SIM_PAGE_SIZE - 1)))
+      sim->prev_command = cmd_written;
+
+    sim->address = index & ~(MICRONUCLEUS_SIM_PAGE_SIZE - 1);
+    if (sim->prev_command != cmd_written && !sim->erase_on_write)
+      sim->address = 0;
+    memset(sim->page, 0xFF, sizeof sim->page);
+    start = sim->address;
+
+    if ((sim->features & MICRONUCLEUS_FEATURE_COMPRESS) && (value >> 8 & 2)) {
+      micronucleus_sim_expand(sim, (unsigned char*) bytes, size);
+    } else {
+      for (i = 0; i + 1 < size; i += 2)
+        micronucleus_sim_fill(sim, (unsigned char) bytes[i] + ((unsigned char) bytes[i+1] << 8));
+    }
+    result = size;
+
+    if (size && sim->address != start) {
+      spm_pages = micronucleus_sim_write(sim);
+      if (spm_pages) command = cmd_written;
+    } else if (sim->features & MICRONUCLEUS_FEATURE_SETUP_WRITE) {
+      command = cmd_fill; // page data follows in cmd_fill requests
+    }
+  } else if (command == cmd_fill && (sim->features & MICRONUCLEUS_FEATURE_SETUP_WRITE)) {
+    command = cmd_info;
+    if (sim->prev_command == cmd_fill) {
+      micronucleus_sim_fill(sim, value & 0xffff);
+      micronucleus_sim_fill(sim, index & 0xffff);
+
+      command = cmd_fill;
+      if (sim->address % MICRONUCLEUS_SIM_PAGE_SIZE == 0) {
+        spm_pages = micronucleus_sim_write(sim);
+        command = cmd_written;
+      }
+    }
+  } else if (command == cmd_status && (sim->features & MICRONUCLEUS_FEATURE_STATUS)) {
+    // reports last action and next address without affecting either
+    unsigned char reply[3] = { sim->prev_command, sim->address & 0xff, sim->address >> 8 & 0xff };
+    result = size < (int) sizeof reply ? size : (int) sizeof reply;
+    memcpy(bytes, reply, result);
+    command = sim->prev_command;
+  } else if ((command == cmd_crc && (sim->features & MICRONUCLEUS_FEATURE_PAGE_CRC)) ||
+             (command == cmd_verify && (sim->features & MICRONUCLEUS_FEATURE_IMAGE_CRC))) {
+    if (size) {
+      // result of previous request
+      result = size < (int) sizeof sim->crc_reply ? size : (int) sizeof sim->crc_reply;
+      memcpy(bytes, sim->crc_reply, result);
+    } else if (command == cmd_crc) {
+      // up to four pages from index
+      unsigned int count = (value & 0xff) < 4 ? (value & 0xff) : 4;
+      for (i = 0; i < (int) count; i++) {
+        unsigned int address = (index + i * MICRONUCLEUS_SIM_PAGE_SIZE) & (MICRONUCLEUS_SIM_FLASH_SIZE - 1) &
+                               ~(MICRONUCLEUS_SIM_PAGE_SIZE - 1);
+        unsigned int crc = micronucleus_sim_crc16(sim->flash + address, MICRONUCLEUS_SIM_PAGE_SIZE);
+        sim->crc_reply[i*2 + 0] = crc >> 0 & 0xff;
+        sim->crc_reply[i*2 + 1] = crc >> 8 & 0xff;
+      }
+      crc_bytes = count * MICRONUCLEUS_SIM_PAGE_SIZE;
+    } else {
+      // everything below index
+      unsigned int length = index < MICRONUCLEUS_SIM_FLASH_SIZE ? index : MICRONUCLEUS_SIM_FLASH_SIZE;
+      unsigned int crc = micronucleus_sim_crc16(sim->flash, length);
+      sim->crc_reply[0] = crc >> 0 & 0xff;
+      sim->crc_reply[1] = crc >> 8 & 0xff;
+      crc_bytes = length;
+    }
+    command = sim->prev_command; // doesn't affect state
+  } else if (command == cmd_patch && (sim->features & MICRONUCLEUS_FEATURE_PATCH_PAGE)) {
+    // changed words of page at index; rest copied from flash, then page is
+    // erased and written
+    command = cmd_info;
+    if (size / 4) {
+      sim->address = index & ~(MICRONUCLEUS_SIM_PAGE_SIZE - 1);
+      sim->erase_on_write = 1;
+      memset(sim->page, 0xFF, sizeof sim->page);
+      micronucleus_sim_patch(sim, (unsigned char*) bytes, size);
+      spm_pages = micronucleus_sim_write(sim);
+      command = spm_pages ? cmd_written : cmd_write;
+    }
+    result = size;
+  } else if (command == cmd_read && (sim->features & MICRONUCLEUS_FEATURE_READ_FLASH)) {
+    // up to 128 bytes from index, without affecting state
+    result = size < 128 ? size : 128;
+    for (i = 0; i < result; i++)
+      bytes[i] = sim->flash[(index + i) & (MICRONUCLEUS_SIM_FLASH_SIZE - 1)];
+    command = sim->prev_command;
+  } else if (command == cmd_erase) {
+    // with chunked erase, a few pages per request, continuing where
+    // previous request stopped
+    sim->erase_count = (sim->features & MICRONUCLEUS_FEATURE_ERASE_CHUNK) ? (value & 0xff) : 0;
+    if (!(sim->features & MICRONUCLEUS_FEATURE_ERASE_CHUNK) || sim->prev_command != cmd_erasing) {
+      sim->address = MICRONUCLEUS_SIM_BOOTLOADER;
+
+      // host can limit erase to below end of its image
+      sim->erase_end = MICRONUCLEUS_SIM_BOOTLOADER;
+      if (sim->features & MICRONUCLEUS_FEATURE_ERASE_RANGE) {
+        sim->erase_end = (index + MICRONUCLEUS_SIM_PAGE_SIZE - 1) & ~(MICRONUCLEUS_SIM_PAGE_SIZE - 1);
+        if (!sim->erase_end || sim->erase_end > MICRONUCLEUS_SIM_BOOTLOADER)
+          sim->erase_end = MICRONUCLEUS_SIM_BOOTLOADER;
+      }
+    }
+    command = micronucleus_sim_erase(sim, &spm_pages, &checked_pages);
+  } else if (command == cmd_run) {
+    sim->running = 1;
+  }
+  sim->prev_command = command;
+
+  // SETUP, DATA and status stages, then device does flash work
+  unsigned long packets = 2 + (result + 7) / 8;
+  delayMicroseconds(MICRONUCLEUS_SIM_FRAME_US + packets * MICRONUCLEUS_SIM_PACKET_US);
+  sim->busy_until = micros() + spm_pages * MICRONUCLEUS_SIM_SPM_US + crc_bytes * MICRONUCLEUS_SIM_CRC_US +
+                    checked_pages * MICRONUCLEUS_SIM_BLANK_US;
+  sim->requests++;
+  sim->packets += packets;
+
+  return result;
+}
+
+static void micronucleus_sim_close(void* device) {
+  free(device);
+}
+
+static const micronucleus_transport micronucleus_sim_transport = {
+  micronucleus_sim_control,
+  micronucleus_sim_close
+};
+
+micronucleus_sim* micronucleus_sim_new(void) {
+  micronucleus_sim* sim = calloc(1, sizeof(micronucleus_sim));
+  if (!sim) return NULL;
+
+  // bootloader itself isn't modelled
+  memset(sim->flash, 0xFF, sizeof sim->flash);
+  memset(sim->page, 0xFF, sizeof sim->page);
+
+  return sim;
+}
+
+micronucleus* micronucleus_sim_connect(micronucleus_sim* sim) {
+  micronucleus_version version = { 1, 10 };
+
+  if (!sim) return NULL;
+
+  micronucleus* nucleus = micronucleus_attach(&micronucleus_sim_transport, sim, version);
+  if (nucleus) strcpy(nucleus->location, "sim");
+
+  return nucleus;
+}
@@ -0,0 +1,94 @@
+#ifndef MICRONUCLEUS_SIM_H
+#define MICRONUCLEUS_SIM_H
+
+/*
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.  
+*/
+
+/********************************************************************************
+* Header files
+********************************************************************************/
+#include "micronucleus_lib.h"
+/*******************************************************************************/
+
+/********************************************************************************
+* Simulated device details. Models an ATtiny85 running the bootloader, with
+* whichever of MICRONUCLEUS_SIM_FEATURES are enabled, so upload strategy and
+* throughput can be measured without hardware.
+********************************************************************************/
+#define MICRONUCLEUS_SIM_FLASH_SIZE  8192
+#define MICRONUCLEUS_SIM_PAGE_SIZE   64
+#define MICRONUCLEUS_SIM_BOOTLOADER  0x1800
+#define MICRONUCLEUS_SIM_WRITE_SLEEP 8    // milliseconds, as device reports
+#define MICRONUCLEUS_SIM_SPM_US      4500 // to erase or write one page; CPU halts meanwhile
+#define MICRONUCLEUS_SIM_FRAME_US    1000 // each control transfer starts in a new frame
+#define MICRONUCLEUS_SIM_PACKET_US   120  // each 8-byte transaction at 1.5 Mbit/s, with token and handshake
+#define MICRONUCLEUS_SIM_CRC_US      1    // per byte of flash CRCed; device doesn't answer meanwhile
+#define MICRONUCLEUS_SIM_BLANK_US    16   // to check a page is blank before erasing it
+
+// optional features the simulated device can have
+#define MICRONUCLEUS_SIM_FEATURES (MICRONUCLEUS_FEATURE_SETUP_WRITE | MICRONUCLEUS_FEATURE_STATUS |\
+    MICRONUCLEUS_FEATURE_SKIP_BLANK | MICRONUCLEUS_FEATURE_ERASE_RANGE |\
+    MICRONUCLEUS_FEATURE_ERASE_WRITE | MICRONUCLEUS_FEATURE_ERASE_CHUNK |\
+    MICRONUCLEUS_FEATURE_PAGE_CRC | MICRONUCLEUS_FEATURE_IMAGE_CRC |\
+    MICRONUCLEUS_FEATURE_READ_FLASH | MICRONUCLEUS_FEATURE_PATCH_PAGE |\
+    MICRONUCLEUS_FEATURE_COMPRESS | MICRONUCLEUS_FEATURE_RESUME)
+/*******************************************************************************/
+
+/********************************************************************************
+* Declearations
+********************************************************************************/
+typedef struct _micronucleus_sim {
+  unsigned char flash[MICRONUCLEUS_SIM_FLASH_SIZE];
+  unsigned char page[MICRONUCLEUS_SIM_PAGE_SIZE]; // page buffer that writes fill
+  unsigned int  address;          // next address to fill
+  unsigned int  user_reset;       // program's reset vector, from page 0
+  unsigned char prev_command;
+  unsigned char running;          // left bootloader, so no longer answers
+  unsigned int  features;         // MICRONUCLEUS_SIM_FEATURES to have, set before connecting
+  unsigned char erase_on_write;   // erase page just before writing it, as host asked
+  unsigned int  erase_count;      // pages left to erase in this request; 0 for no limit
+  unsigned int  erase_end;        // end of image area to erase
+  unsigned char crc_reply[8];     // result of last CRC request
+  unsigned long long busy_until;  // micros() when erase or write is finished
+  // statistics
+  unsigned long requests;         // control transfers answered
+  unsigned long packets;          // transactions on bus, including SETUP and status
+  unsigned long pages_erased;
+  unsigned long pages_written;
+} micronucleus_sim;
+/*******************************************************************************/
+
+/********************************************************************************
+* Make a simulated device, with its flash blank below the bootloader and no
+* optional features
+*     Returns: simulated device for success, NULL for fail
+********************************************************************************/
+micronucleus_sim* micronucleus_sim_new(void);
+/*******************************************************************************/
+
+/********************************************************************************
+* Connect to simulated device. Handle takes ownership of it, so closing handle
+* frees it.
+*     Returns: device handle for success, NULL for fail
+********************************************************************************/
+micronucleus* micronucleus_sim_connect(micronucleus_sim* sim);
+/*******************************************************************************/
+
+#endif
@@ -0,0 +1,296 @@
+/*
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/***************************************************************/
+/* Transport for devices on libusb-0.1                         */
+/***************************************************************/
+#include "micronucleus_lib.h"
+#include "littleWire_util.h"
+#include <stdio.h>
+#include <string.h>
+
+#if defined LINUX
+  #include <dirent.h>
+  #include <poll.h>
+  #include <sys/inotify.h>
+  #include <unistd.h>
+
+  #define USB_DEVICE_DIR "/dev/bus/usb"
+
+  static int micronucleus_deviceNotify(void);
+#endif
+
+static int micronucleus_usb_control(void* device, int requesttype, int request, int value,
+                                    int index, char* bytes, int size, int timeout) {
+  return usb_control_msg(device, requesttype, request, value, index, bytes, size, timeout);
+}
+
+static void micronucleus_usb_close(void* device) {
+  usb_close(device);
+}
+
+static const micronucleus_transport micronucleus_usb_transport = {
+  micronucleus_usb_control,
+  micronucleus_usb_close
+};
+
+// what was learned by opening a device, kept for when it's listed again
+typedef struct {
+  char location[32];
+  char serial[32];
+  unsigned char info[MICRONUCLEUS_INFO_SIZE];
+  int info_length;
+  int listed;               // seen by latest micronucleus_list
+} micronucleus_usb_known;
+
+#define MICRONUCLEUS_USB_KNOWN 64 // devices remembered
+#define MICRONUCLEUS_USB_LIST 128 // most devices connectMatching looks at
+
+static micronucleus_usb_known micronucleus_usb_knowns[MICRONUCLEUS_USB_KNOWN];
+static int micronucleus_usb_next_known = 0; // replaced next
+
+// Returns what's known about device at location, or NULL if nothing. If add
+// is set, makes a blank record for it instead.
+static micronucleus_usb_known* micronucleus_usb_find(const char* location, int add) {
+  micronucleus_usb_known* known;
+  int i;
+
+  for (i = 0; i < MICRONUCLEUS_USB_KNOWN; i++) {
+    if (strcmp(micronucleus_usb_knowns[i].location, location) == 0)
+      return &micronucleus_usb_knowns[i];
+  }
+
+  if (!add) return NULL;
+
+  known = &micronucleus_usb_knowns[micronucleus_usb_next_known];
+  micronucleus_usb_next_known = (micronucleus_usb_next_known + 1) % MICRONUCLEUS_USB_KNOWN;
+  memset(known, 0, sizeof *known);
+  strcpy(known->location, location);
+
+  return known;
+}
+
+// Reads serial number of listed device into entry, using handle already open
+static void micronucleus_usb_readSerial(micronucleus_entry* entry, usb_dev_handle* handle) {
+  struct usb_device* dev = entry->device;
+
+  if (usb_get_string_simple(handle, dev->descriptor.iSerialNumber, entry->serial, sizeof entry->serial) < 0)
+    entry->serial[0] = 0;
+
+  strcpy(micronucleus_usb_find(entry->location, 1)->serial, entry->serial);
+}
+
+int micronucleus_list(micronucleus_entry* entries, int max) {
+  struct usb_bus *busses;
+  int count = 0, i;
+
+#if defined LINUX
+  // watch before looking, so a device that turns up in between still wakes
+  // micronucleus_waitChange() rather than waiting out its timeout
+  micronucleus_deviceNotify();
+#endif
+
+  // intialise usb and find micronucleus devices
+  usb_init();
+  usb_find_busses();
+  usb_find_devices();
+
+  for (i = 0; i < MICRONUCLEUS_USB_KNOWN; i++)
+    micronucleus_usb_knowns[i].listed = 0;
+
+  busses = usb_get_busses();
+  struct usb_bus *bus;
+  for (bus = busses; bus; bus = bus->next) {
+    struct usb_device *dev;
+
+    for (dev = bus->devices; dev; dev = dev->next) {
+      /* Check if this device is a micronucleus */
+      if (dev->descriptor.idVendor == MICRONUCLEUS_VENDOR_ID && dev->descriptor.idProduct == MICRONUCLEUS_PRODUCT_ID)  {
+        micronucleus_entry entry;
+        micronucleus_usb_known* known;
+
+        memset(&entry, 0, sizeof entry);
+        snprintf(entry.location, sizeof entry.location, "%.15s/%.15s", bus->dirname, dev->filename);
+        entry.version.major = (dev->descriptor.bcdDevice >> 8) & 0xFF;
+        entry.version.minor = dev->descriptor.bcdDevice & 0xFF;
+        entry.has_serial = dev->descriptor.iSerialNumber != 0;
+        entry.device = dev;
+
+        // every device is looked at, even past max, so what's known about
+        // those still here isn't forgotten below
+        known = micronucleus_usb_find(entry.location, 0);
+        if (known) {
+          known->listed = 1;
+          strcpy(entry.serial, known->serial);
+          memcpy(entry.info, known->info, sizeof entry.info);
+          entry.info_length = known->info_length;
+        }
+
+        if (count < max) entries[count++] = entry;
+      }
+    }
+  }
+
+  // device numbers are reused, so what was known about a device that's gone
+  // mustn't be taken for whatever turns up at its location next
+  for (i = 0; i < MICRONUCLEUS_USB_KNOWN; i++) {
+    if (!micronucleus_usb_knowns[i].listed)
+      memset(&micronucleus_usb_knowns[i], 0, sizeof micronucleus_usb_knowns[i]);
+  }
+
+  return count;
+}
+
+micronucleus* micronucleus_open(micronucleus_entry* entry) {
+  micronucleus_usb_known* known;
+  micronucleus* nucleus;
+  usb_dev_handle* handle;
+
+  handle = usb_open(entry->device);
+  if (!handle) return NULL;
+
+  if (entry->has_serial && !entry->serial[0]) micronucleus_usb_readSerial(entry, handle);
+
+  nucleus = micronucleus_attachInfo(&micronucleus_usb_transport, handle, entry->version,
+                                    entry->info, &entry->info_length);
+  if (!nucleus) return NULL;
+
+  strcpy(nucleus->location, entry->location);
+  strcpy(nucleus->serial, entry->serial);
+
+  // count of used pages changes as flash is written, so ask again for that
+  known = micronucleus_usb_find(entry->location, 1);
+  if (!(nucleus->features & MICRONUCLEUS_FEATURE_SKIP_BLANK)) {
+    memcpy(known->info, entry->info, sizeof known->info);
+    known->info_length = entry->info_length;
+  }
+
+  return nucleus;
+}
+
+int micronucleus_connectMatching(micronucleus** devices, int max, const char* selector) {
+  micronucleus_entry entries[MICRONUCLEUS_USB_LIST];
+  int any = !selector || !selector[0] || strcmp(selector, "*") == 0;
+  int listed, count = 0, i;
+
+  listed = micronucleus_list(entries, MICRONUCLEUS_USB_LIST);
+
+  for (i = 0; i < listed && count < max; i++) {
+    micronucleus_entry* entry = &entries[i];
+
+    if (!any && strcmp(selector, entry->location) != 0) {
+      // only a serial number can match now
+      if (!entry->has_serial) continue;
+
+      if (!entry->serial[0]) {
+        usb_dev_handle* handle = usb_open(entry->device);
+        if (!handle) continue;
+        micronucleus_usb_readSerial(entry, handle);
+        usb_close(handle);
+      }
+
+      if (strcmp(selector, entry->serial) != 0) continue;
+    }
+
+    micronucleus* nucleus = micronucleus_open(entry);
+    if (nucleus) devices[count++] = nucleus;
+  }
+
+  return count;
+}
+
+int micronucleus_connectAll(micronucleus** devices, int max) {
+  return micronucleus_connectMatching(devices, max, NULL);
+}
+
+micronucleus* micronucleus_connect() {
+  micronucleus *nucleus = NULL;
+
+  if (micronucleus_connectAll(&nucleus, 1) != 1) return NULL;
+
+  return nucleus;
+}
+
+#if defined LINUX
+// Watches a bus directory for device nodes being added, or having their
+// permissions set once udev gets to them
+static void micronucleus_watchBus(int notify, const char* name) {
+  char path[sizeof USB_DEVICE_DIR + 256];
+
+  snprintf(path, sizeof path, USB_DEVICE_DIR "/%s", name);
+  inotify_add_watch(notify, path, IN_CREATE | IN_ATTRIB);
+}
+
+// Returns inotify descriptor watching for new devices, or -1 if unavailable
+static int micronucleus_deviceNotify(void) {
+  static int notify = -2;
+  DIR *dir;
+  struct dirent *entry;
+
+  if (notify != -2) return notify;
+
+  notify = inotify_init();
+  if (notify < 0) return notify;
+
+  // watch for new buses too
+  if (inotify_add_watch(notify, USB_DEVICE_DIR, IN_CREATE) < 0 ||
+      (dir = opendir(USB_DEVICE_DIR)) == NULL) {
+    close(notify);
+    notify = -1;
+    return notify;
+  }
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.') micronucleus_watchBus(notify, entry->d_name);
+  }
+  closedir(dir);
+
+  return notify;
+}
+#endif
+
+int micronucleus_waitChange(unsigned int timeout) {
+#if defined LINUX
+  int notify = micronucleus_deviceNotify();
+
+  if (notify >= 0) {
+    struct pollfd pending = { notify, POLLIN, 0 };
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    char *next;
+
+    if (poll(&pending, 1, timeout) <= 0) return 0;
+
+    length = read(notify, events, sizeof events);
+    for (next = events; length > 0 && next < events + length; ) {
+      struct inotify_event *event = (struct inotify_event*) next;
+      if ((event->mask & IN_CREATE) && (event->mask & IN_ISDIR))
+        micronucleus_watchBus(notify, event->name);
+      next += sizeof(struct inotify_event) + event->len;
+    }
+
+    return 1;
+  }
+#endif
+
+  // no notifications, so have caller look every so often
+  delay(timeout < 100 ? timeout : 100);
+  return 1;
+}
@@ -14,6 +14,60 @@
 // vector patching. Saves 36 bytes.
 //#define MICRONUCLEUS_VERSION_MAJOR 2
 
+// Uncomment to accept page data two words at a time in the SETUP packet of
+// write requests, rather than in a DATA stage. Host uses it if available.
+//#define SETUP_WRITE 1
+
+// Uncomment to support a status request, so host can poll until a flash
+// erase or write is done rather than sleeping for a fixed time
+//#define STATUS_COMMAND 1
+
+// Uncomment to have erase skip pages that are already blank, and report the
+// number of non-blank pages so host knows how long erase will take
+//#define SKIP_BLANK_PAGES 1
+
+// Uncomment to let host limit erase to the pages its image will use
+//#define ERASE_RANGE 1
+
+// Uncomment to let host have each page erased just before it's written,
+// rather than erasing everything first. Power loss during the few ms that
+// page 0 is blank leaves old code above it running instead of bootloader.
+//#define ERASE_ON_WRITE 1
+
+// Uncomment to let host erase a few pages per request, so device doesn't go
+// silent on USB long enough to be dropped by the host
+//#define CHUNKED_ERASE 1
+
+// Uncomment to support a request for the CRC of flash pages, so that along
+// with ERASE_ON_WRITE the host can rewrite only pages that changed
+//#define PAGE_CRC 1
+
+// Uncomment to support a request for the CRC of all flash below an address,
+// so host can verify an upload without reading it back
+//#define IMAGE_CRC 1
+
+// Uncomment to support a request for reading flash, so host can save what's
+// on a device
+//#define READ_FLASH 1
+
+// Uncomment to support writing only the words that changed in a page, the
+// rest being copied from flash. Requires ERASE_ON_WRITE.
+//#define PATCH_PAGE 1
+
+// Uncomment to support run-length encoded page data in writes, so runs of the
+// same word are sent only once
+//#define COMPRESS_WRITE 1
+
+// Uncomment to let a write request carry on at the page the device was on,
+// so host can resume an upload after a USB error rather than erasing and
+// starting over. Requires STATUS_COMMAND.
+//#define RESUME_WRITE 1
+
+// Uncomment to report a USB serial number, as eight hex digits, so host can
+// pick out one device without opening the others. Usually given per unit when
+// building, with make SERIAL=0x00C0FFEE.
+//#define SERIAL_NUMBER 0x00000001
+
 // Uncomment to delay rather than erase/write flash, so USB timing can be tested
 // without wearing out device
 //#define SIMULATE_FLASH 1
@@ -15,6 +15,7 @@ Copyright (c) 2013 Shay Green */
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 
 // how many milliseconds should host wait till it sends another erase or write?
 // needs to be above 4.5 (and a whole integer) as avr freezes for 4.5ms
@@ -30,6 +31,8 @@ Copyright (c) 2013 Shay Green */
 
 #define RESET_VECTOR_ADDR 0
 
+enum { rjmp_bootloader = BOOTLOADER_ADDRESS/2 - 1 + 0xc000 };
+
 static void leaveBootloader( void ) __attribute__((noreturn)); // optimization
 
 #include "bootloaderconfig.h"
@@ -38,9 +41,70 @@ static void leaveBootloader( void ) __attribute__((noreturn)); // optimization
 enum { cmd_info    = 0 };
 enum { cmd_write   = 1 };
 enum { cmd_erase   = 2 };
+enum { cmd_fill    = 3 };
+enum { cmd_run     = 4 };
+enum { cmd_status  = 5 };
+enum { cmd_crc     = 6 };
+enum { cmd_verify  = 7 };
+enum { cmd_read    = 8 };
+enum { cmd_patch   = 9 };
 enum { cmd_written = 0x80 };
+enum { cmd_erased  = 0x81 };
+enum { cmd_erasing = 0x82 };
 static uchar    prevCommand;
 static unsigned currentAddress;
+static uchar    eraseCount; // pages left to erase in this request; 0 for no limit
+
+#if ERASE_RANGE
+	static unsigned eraseEnd; // end of image area to erase
+#endif
+
+#if ERASE_ON_WRITE
+	static uchar eraseOnWrite; // erase each page just before writing it
+#endif
+
+// Optional features, appended to info reply so host knows what it can use
+enum { feature_setup_write = 0x0001 };
+enum { feature_status      = 0x0002 };
+enum { feature_skip_blank  = 0x0004 };
+enum { feature_erase_range = 0x0008 };
+enum { feature_erase_write = 0x0010 };
+enum { feature_erase_chunk = 0x0020 };
+enum { feature_page_crc    = 0x0040 };
+enum { feature_image_crc   = 0x0080 };
+enum { feature_read_flash  = 0x0100 };
+enum { feature_patch_page  = 0x0200 };
+enum { feature_compress    = 0x0400 };
+enum { feature_resume      = 0x0800 };
+
+#define FEATURES (\
+	(SETUP_WRITE      ? feature_setup_write : 0) |\
+	(STATUS_COMMAND   ? feature_status      : 0) |\
+	(SKIP_BLANK_PAGES ? feature_skip_blank  : 0) |\
+	(ERASE_RANGE      ? feature_erase_range : 0) |\
+	(ERASE_ON_WRITE   ? feature_erase_write : 0) |\
+	(CHUNKED_ERASE    ? feature_erase_chunk : 0) |\
+	(PAGE_CRC         ? feature_page_crc    : 0) |\
+	(IMAGE_CRC        ? feature_image_crc   : 0) |\
+	(READ_FLASH       ? feature_read_flash  : 0) |\
+	(PATCH_PAGE       ? feature_patch_page  : 0) |\
+	(COMPRESS_WRITE   ? feature_compress    : 0) |\
+	(RESUME_WRITE     ? feature_resume      : 0))
+
+#if PATCH_PAGE && !ERASE_ON_WRITE
+	#error "PATCH_PAGE requires ERASE_ON_WRITE"
+#endif
+
+#if RESUME_WRITE && !STATUS_COMMAND
+	#error "RESUME_WRITE requires STATUS_COMMAND"
+#endif
+
+#if READ_FLASH
+	// Defined in usbdrv.c, which we include at the end. Lets a reply come
+	// straight from flash like the driver's descriptors.
+	static uchar usbMsgFlags;
+	#define USB_FLG_MSGPTR_IS_ROM   (1<<6)
+#endif
 
 #ifndef boot_page_fill_clear
 #define boot_page_fill_clear()                   \
@@ -56,92 +120,452 @@ static unsigned currentAddress;
 }))
 #endif
 
+// Adds word to page buffer at currentAddress, patching reset vectors
+static void fill_word( unsigned data )
+{
+	#if MICRONUCLEUS_VERSION_MAJOR >= 2
+		if ( currentAddress == RESET_VECTOR_ADDR )
+			data = rjmp_bootloader;
+	#else
+		static unsigned userReset;
+		
+		if ( currentAddress == RESET_VECTOR_ADDR )
+		{
+			// Save app's reset vector and replace with ours
+			userReset = data;
+			data = rjmp_bootloader;
+		}
+		
+		if ( currentAddress == USER_RESET_ADDR )
+		{
+			// Relocate app's reset rjmp and adjust offset for new address
+			data = (userReset + 0x1000 - USER_RESET_ADDR/2) & ~0x1000;
+		}
+	#endif
+	
+	boot_page_fill( currentAddress, data );
+	currentAddress += 2;
+}
+
+#if PATCH_PAGE
+static uchar    patchCount; // changed words still to come in cmd_patch DATA stage
+static unsigned patchEnd;   // end of page being patched
+
+// Fills page buffer with what's already in flash, up to addr
+static void copy_flash( unsigned addr )
+{
+	while ( currentAddress < addr )
+	{
+		boot_page_fill( currentAddress, pgm_read_word( currentAddress ) );
+		currentAddress += 2;
+	}
+}
+
+// Called with DATA stage of cmd_patch, holding address then value of each
+// changed word, in ascending order. Returns 1 once page buffer is full.
+static uchar patch_words( uchar* buf, uchar len )
+{
+	do
+	{
+		unsigned addr = ((uint16_t*) buf) [0] & ~1;
+		unsigned data = ((uint16_t*) buf) [1];
+		buf += 4;
+		
+		// Ignore any out of order or outside page
+		if ( addr >= currentAddress && addr < patchEnd )
+		{
+			copy_flash( addr );
+			
+			// Words are written as given, except that reset vector must
+			// still jump to us
+			if ( addr == RESET_VECTOR_ADDR )
+				data = rjmp_bootloader;
+			
+			boot_page_fill( addr, data );
+			currentAddress += 2;
+		}
+		
+		if ( !--patchCount )
+		{
+			copy_flash( patchEnd );
+			return 1;
+		}
+	}
+	while ( len -= 4 );
+	
+	return 0;
+}
+#endif
+
+#if COMPRESS_WRITE
+static uchar compressed; // cmd_write DATA stage is run-length encoded
+static uchar rleCount;   // words left in current record; 0 if next word starts one
+static uchar rleRepeat;  // current record repeats one word rather than listing them
+
+// Called with compressed DATA stage of cmd_write. Each record starts with a
+// word with count in low byte, followed by either that many words (high byte
+// 0) or one word to fill that many times (high byte 1).
+static void expand_words( uchar* buf, uchar len )
+{
+	do
+	{
+		unsigned data = *(uint16_t*) buf;
+		buf += 2;
+		
+		if ( !rleCount )
+		{
+			rleCount  = data & 0xff;
+			rleRepeat = data >> 8;
+			continue;
+		}
+		
+		// Run stops at end of page
+		do
+			fill_word( data );
+		while ( --rleCount && rleRepeat && currentAddress % SPM_PAGESIZE );
+	}
+	while ( len -= 2 );
+}
+#endif
+
+#if SKIP_BLANK_PAGES
+static uchar usedPages; // number of non-blank pages below bootloader
+
+// True if page at addr is already erased
+static uchar page_blank( unsigned addr )
+{
+	uchar n = SPM_PAGESIZE / 2;
+	do {
+		if ( pgm_read_word( addr ) != 0xFFFF )
+			return 0;
+		addr += 2;
+	}
+	while ( --n );
+	
+	return 1;
+}
+#else
+	#define page_blank( addr ) 0
+#endif
+
+static void erase_page( unsigned addr )
+{
+	if ( !page_blank( addr ) )
+	{
+		boot_page_erase( addr );
+		#if SKIP_BLANK_PAGES
+			usedPages--;
+		#endif
+	}
+	wdt_reset();
+}
+
+// Erases from currentAddress down to beginning of flash, eraseCount pages at
+// most, leaving currentAddress where it stopped. An eraseCount of 0 erases all
+// the way down, however many pages that is.
+static void erase_flash( void )
+{
+	unsigned addr = currentAddress;
+	
+	do {
+		addr -= SPM_PAGESIZE;
+		erase_page( addr );
+		
+		#if ERASE_RANGE
+			// Last page holds user reset rjmp and is always written, so it's
+			// erased first, then we skip down to end of image. Page 0 still
+			// jumps to us.
+			if ( addr > eraseEnd )
+				addr = eraseEnd;
+		#endif
+	}
+	while ( addr && (!eraseCount || --eraseCount) );
+	
+	currentAddress = addr;
+	prevCommand = cmd_erasing;
+	if ( addr )
+		return;
+	
+	#if ERASE_RANGE
+		// Pages above image may still hold old code, so rather than leave
+		// page 0 blank, have reset vector jump to us until host writes it
+		if ( eraseEnd < BOOTLOADER_ADDRESS - SPM_PAGESIZE )
+		{
+			boot_page_fill_clear();
+			boot_page_fill( RESET_VECTOR_ADDR, rjmp_bootloader );
+			boot_page_write( RESET_VECTOR_ADDR );
+			#if SKIP_BLANK_PAGES
+				usedPages++;
+			#endif
+		}
+	#endif
+	
+	prevCommand = cmd_erased;
+}
+
 static void write_flash( void )
 {
 	if ( currentAddress - 2 < BOOTLOADER_ADDRESS )
 	{
+		#if ERASE_ON_WRITE
+			// Page buffer is already filled, so page is only blank until the
+			// write below finishes, with no USB activity in between
+			if ( eraseOnWrite )
+				erase_page( currentAddress - 2 );
+		#endif
+		
+		#if SKIP_BLANK_PAGES
+			if ( page_blank( currentAddress - 2 ) )
+				usedPages++;
+		#endif
+		
 		boot_page_write( currentAddress - 2 );
 		prevCommand = cmd_written;
 	}
 }
 
-static void erase_flash( void )
+#if PAGE_CRC || IMAGE_CRC
+static unsigned crcReply [4];
+static unsigned crcAddress;
+static unsigned crcLength;
+static uchar    crcCount; // non-zero when calc_crcs() needs to be run
+
+// Fills crcReply with CRC of crcCount consecutive areas of flash, each
+// crcLength bytes. Same CRC as usbCrc16(), which can only read from RAM.
+static void calc_crcs( void )
 {
-	unsigned addr = BOOTLOADER_ADDRESS;
+	uchar i = 0;
 	do {
-        addr -= SPM_PAGESIZE;
-        boot_page_erase( addr );
-        wdt_reset();
+		unsigned crc = 0xFFFF;
+		unsigned n = crcLength;
+		while ( n-- )
+			crc = _crc16_update( crc, pgm_read_byte( crcAddress++ ) );
+		crcReply [i] = ~crc;
+		wdt_reset();
 	}
-	while ( addr );
+	while ( ++i < crcCount );
+	
+	crcCount = 0;
 }
+#endif
 
 uchar usbFunctionSetup( uchar data [8] )
 {
 	const usbRequest_t* rq = (const usbRequest_t*) data;
 	
-	static const uchar replyBuffer [4] = {
+	static uchar replyBuffer [6 + SKIP_BLANK_PAGES] = {
 		PROGMEM_SIZE >> 8 & 0xff,
 		PROGMEM_SIZE      & 0xff,
 		SPM_PAGESIZE,
-		MICRONUCLEUS_WRITE_SLEEP
+		MICRONUCLEUS_WRITE_SLEEP,
+		FEATURES      & 0xff,
+		FEATURES >> 8 & 0xff
 	};
 	
+	uchar command = rq->bRequest;
 	uchar result = 0;
 	
-	if ( rq->bRequest == cmd_info )
+	if ( command == cmd_info )
 	{
+		#if SKIP_BLANK_PAGES
+			// Number of pages erase will actually have to erase
+			replyBuffer [6] = usedPages;
+		#endif
+		
+		// Doesn't affect state, so host reconnecting after a USB error
+		// can still see from status how far erase or write got
 		usbMsgPtr = (usbMsgPtr_t) replyBuffer;
-		result = sizeof replyBuffer;
+		return sizeof replyBuffer;
 	}
-	else if ( rq->bRequest == cmd_write )
+	else if ( command == cmd_write )
 	{
+		#if ERASE_ON_WRITE
+			// Host can skip erase command and have each page erased as written.
+			// Page 0 still jumps to us, so host can also skip unchanged pages.
+			eraseOnWrite = rq->wValue.bytes [1] & 1;
+		#else
+			enum { eraseOnWrite = 0 };
+		#endif
+		
+		#if RESUME_WRITE
+			// After a USB error, host can also carry on with the page we were
+			// on, whatever it sent since. A partial erase still forces page 0.
+			if ( prevCommand != cmd_erasing &&
+					!((rq->wIndex.word ^ currentAddress) & ~(SPM_PAGESIZE - 1)) )
+				prevCommand = cmd_written;
+		#endif
+		
 		currentAddress = rq->wIndex.word & ~(SPM_PAGESIZE - 1);
-		if ( prevCommand != cmd_written )
+		if ( prevCommand != cmd_written && !eraseOnWrite )
 			currentAddress = 0;
 		
 		// Required in case page is already partially filled
 		boot_page_fill_clear();
+		
+		#if PATCH_PAGE
+			// In case previous cmd_patch didn't get all its data
+			patchCount = 0;
+		#endif
+		
+		#if COMPRESS_WRITE
+			// Host can run-length encode page data
+			compressed = rq->wValue.bytes [1] & 2;
+			rleCount = 0;
+		#endif
 	
 		result = USB_NO_MSG; // hands off work to usbFunctionWrite
+		
+		#if SETUP_WRITE
+			// No DATA stage; page data follows in cmd_fill requests
+			if ( !rq->wLength.word )
+			{
+				result = 0;
+				command = cmd_fill;
+			}
+		#endif
+	}
+	else if ( command == cmd_erase )
+	{
+		eraseCount = 0; // no limit
+		
+		#if CHUNKED_ERASE
+			// Host can erase a few pages per request so we don't go silent
+			// on USB for long. Continues where previous request stopped.
+			eraseCount = rq->wValue.bytes [0];
+			if ( prevCommand != cmd_erasing )
+		#endif
+		{
+			currentAddress = BOOTLOADER_ADDRESS;
+			
+			#if ERASE_RANGE
+				// Host can limit erase to below end of its image
+				eraseEnd = (rq->wIndex.word + SPM_PAGESIZE - 1) & ~(SPM_PAGESIZE - 1);
+				if ( !eraseEnd || eraseEnd > BOOTLOADER_ADDRESS )
+					eraseEnd = BOOTLOADER_ADDRESS;
+			#endif
+		}
 	}
+	#if STATUS_COMMAND
+		else if ( command == cmd_status )
+		{
+			// Any reply means we're not busy with flash. Reports last action
+			// and next address to write, without affecting either.
+			static uchar statusReply [3];
+			statusReply [0] = prevCommand;
+			statusReply [1] = currentAddress      & 0xff;
+			statusReply [2] = currentAddress >> 8 & 0xff;
+			usbMsgPtr = (usbMsgPtr_t) statusReply;
+			return sizeof statusReply;
+		}
+	#endif
+	#if PAGE_CRC || IMAGE_CRC
+		else if ( command == cmd_crc || command == cmd_verify )
+		{
+			// Takes too long to do before replying, so host starts it with
+			// no DATA stage and then reads result with another request.
+			// Doesn't affect state.
+			if ( rq->wLength.word )
+			{
+				usbMsgPtr = (usbMsgPtr_t) crcReply;
+				return sizeof crcReply;
+			}
+			
+			// CRC of up to four pages starting at wIndex, so host can skip
+			// writing ones that haven't changed
+			crcAddress = rq->wIndex.word;
+			crcLength  = SPM_PAGESIZE;
+			crcCount   = rq->wValue.bytes [0];
+			if ( crcCount > 4 )
+				crcCount = 4;
+			
+			#if IMAGE_CRC
+				// CRC of everything below wIndex, so host can verify upload
+				// without reading flash back
+				if ( command == cmd_verify )
+				{
+					crcLength  = crcAddress;
+					crcAddress = 0;
+					crcCount   = 1;
+				}
+			#endif
+			return 0;
+		}
+	#endif
+	#if PATCH_PAGE
+		else if ( command == cmd_patch )
+		{
+			// Only words that changed in page at wIndex are in DATA stage,
+			// four bytes each. Rest are copied from flash, then page is
+			// erased and written like an erase-on-write cmd_write.
+			command = cmd_info;
+			patchCount = rq->wLength.bytes [0] / 4;
+			if ( patchCount )
+			{
+				currentAddress = rq->wIndex.word & ~(SPM_PAGESIZE - 1);
+				patchEnd = currentAddress + SPM_PAGESIZE;
+				eraseOnWrite = 1;
+				boot_page_fill_clear();
+				command = cmd_write;
+				result = USB_NO_MSG; // hands off work to usbFunctionWrite
+			}
+		}
+	#endif
+	#if READ_FLASH
+		else if ( command == cmd_read )
+		{
+			// Up to 128 bytes of flash from wIndex, sent as driver reads it
+			// so no RAM is needed. Doesn't affect state.
+			usbMsgPtr   = (usbMsgPtr_t) rq->wIndex.word;
+			usbMsgFlags = USB_FLG_MSGPTR_IS_ROM;
+			return 128;
+		}
+	#endif
+	#if SETUP_WRITE
+		else if ( command == cmd_fill )
+		{
+			// Two words of page data in wValue and wIndex. Ignored unless
+			// a page was started with cmd_write.
+			command = cmd_info;
+			if ( prevCommand == cmd_fill )
+			{
+				fill_word( rq->wValue.word );
+				fill_word( rq->wIndex.word );
+				
+				command = cmd_fill;
+				if ( currentAddress % SPM_PAGESIZE == 0 )
+					command = cmd_write; // page complete; write after reply
+			}
+		}
+	#endif
 	
-	prevCommand = rq->bRequest;
+	prevCommand = command;
 	return result;
 }
 
 // Called multiple times by usbdrv with a few bytes at a time of the page
 uchar usbFunctionWrite( uchar* buf, uchar len )
 {
+	#if PATCH_PAGE
+		if ( patchCount )
+			return patch_words( buf, len );
+	#endif
+	
+	#if COMPRESS_WRITE
+		if ( compressed )
+		{
+			unsigned start = currentAddress;
+			expand_words( buf, len );
+			
+			// Final once this packet filled last of page. Full address is
+			// compared, since low byte alone is 0 at every 256-byte page.
+			return currentAddress % SPM_PAGESIZE == 0 && currentAddress != start;
+		}
+	#endif
+	
 	do
 	{
-		unsigned data = *(uint16_t*) buf;
+		fill_word( *(uint16_t*) buf );
 		buf += 2;
-		
-		enum { rjmp_bootloader = BOOTLOADER_ADDRESS/2 - 1 + 0xc000 };
-		
-		#if MICRONUCLEUS_VERSION_MAJOR >= 2
-			if ( currentAddress == RESET_VECTOR_ADDR )
-				data = rjmp_bootloader;
-		#else
-			static unsigned userReset;
-			
-			if ( currentAddress == RESET_VECTOR_ADDR )
-			{
-				// Save app's reset vector and replace with ours
-				userReset = data;
-				data = rjmp_bootloader;
-			}
-			
-			if ( currentAddress == USER_RESET_ADDR )
-			{
-				// Relocate app's reset rjmp and adjust offset for new address
-				data = (userReset + 0x1000 - USER_RESET_ADDR/2) & ~0x1000;
-			}
-		#endif
-		
-		boot_page_fill( currentAddress, data );
-		currentAddress += 2;
 	}
 	while ( len -= 2 );
 	
@@ -229,6 +653,17 @@ int main( void )
 	// Allow user to see registers before any disruption
 	bootLoaderInit();
 	
+	#if SKIP_BLANK_PAGES
+		// Count now rather than when host asks, since USB can't be serviced
+		// while we scan flash. Erase and write keep it up to date.
+		unsigned addr = 0;
+		do {
+			if ( !page_blank( addr ) )
+				usedPages++;
+		}
+		while ( (addr += SPM_PAGESIZE) < BOOTLOADER_ADDRESS );
+	#endif
+	
 	initHardware(); // gives time for jumper pull-ups to stabilize
 	
 	while ( bootLoaderCondition() )
@@ -239,11 +674,9 @@ int main( void )
 			prevTxLen = usbTxLen;
 			wait_usb_interrupt();
 		}
-		while ( !(prevCommand != cmd_info &&
-				usbTxLen == USBPID_NAK && prevTxLen != USBPID_NAK) );
+		while ( !(usbTxLen == USBPID_NAK && prevTxLen != USBPID_NAK) );
 		
-		// Stops once we have a command and we've just transmitted the final reply
-		// back to host
+		// Stops once we've just transmitted the final reply back to host
 		
 		// Now we can ignore USB until our host program makes another request
 		
@@ -251,8 +684,13 @@ int main( void )
 			erase_flash();
 		else if ( prevCommand == cmd_write )
 			write_flash();
-		else
+		else if ( prevCommand == cmd_run )
 			break;
+		
+		#if PAGE_CRC || IMAGE_CRC
+			if ( crcCount )
+				calc_crcs();
+		#endif
 	}
 	
 	leaveBootloader();
@@ -31,6 +31,54 @@
 	#define MICRONUCLEUS_VERSION_MINOR 0
 #endif
 
+#ifndef SETUP_WRITE
+	#define SETUP_WRITE 0
+#endif
+
+#ifndef STATUS_COMMAND
+	#define STATUS_COMMAND 0
+#endif
+
+#ifndef SKIP_BLANK_PAGES
+	#define SKIP_BLANK_PAGES 0
+#endif
+
+#ifndef ERASE_RANGE
+	#define ERASE_RANGE 0
+#endif
+
+#ifndef ERASE_ON_WRITE
+	#define ERASE_ON_WRITE 0
+#endif
+
+#ifndef CHUNKED_ERASE
+	#define CHUNKED_ERASE 0
+#endif
+
+#ifndef PAGE_CRC
+	#define PAGE_CRC 0
+#endif
+
+#ifndef IMAGE_CRC
+	#define IMAGE_CRC 0
+#endif
+
+#ifndef READ_FLASH
+	#define READ_FLASH 0
+#endif
+
+#ifndef PATCH_PAGE
+	#define PATCH_PAGE 0
+#endif
+
+#ifndef COMPRESS_WRITE
+	#define COMPRESS_WRITE 0
+#endif
+
+#ifndef RESUME_WRITE
+	#define RESUME_WRITE 0
+#endif
+
 #define USB_CFG_CLOCK_KHZ (F_CPU/1000)
 
 #ifndef AUTO_OSCCAL
@@ -260,8 +308,15 @@
  * the macros. See the file USB-IDs-for-free.txt before you assign a name if
  * you use a shared VID/PID.
  */
-/*#define USB_CFG_SERIAL_NUMBER   'N', 'o', 'n', 'e' */
-/*#define USB_CFG_SERIAL_NUMBER_LEN   0 */
+#ifdef SERIAL_NUMBER
+	// one hex digit of SERIAL_NUMBER, as a UTF-16 character
+	#define SERIAL_DIGIT(shift) (((unsigned long) (SERIAL_NUMBER) >> (shift) & 15) < 10 ?\
+		'0' + ((unsigned long) (SERIAL_NUMBER) >> (shift) & 15) :\
+		'A' - 10 + ((unsigned long) (SERIAL_NUMBER) >> (shift) & 15))
+	#define USB_CFG_SERIAL_NUMBER SERIAL_DIGIT(28), SERIAL_DIGIT(24), SERIAL_DIGIT(20),\
+		SERIAL_DIGIT(16), SERIAL_DIGIT(12), SERIAL_DIGIT(8), SERIAL_DIGIT(4), SERIAL_DIGIT(0)
+	#define USB_CFG_SERIAL_NUMBER_LEN 8
+#endif
 /* Same as above for the serial number. If you don't want a serial number,
  * undefine the macros.
  * It may be useful to provide the serial number through other means than at